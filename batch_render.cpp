@@ -0,0 +1,414 @@
+#include "batch_render.hpp"
+#include "journal.hpp"
+#include "loader.hpp"
+#include "renderer.hpp"
+#include "thread_pool.hpp"
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// ---------------- camera presets ----------------
+static const camera_preset NAMED_PRESETS[] = {
+    { "front", 0.0f, 0.0f },
+    { "back", 180.0f, 0.0f },
+    { "left", -90.0f, 0.0f },
+    { "right", 90.0f, 0.0f },
+    { "top", 0.0f, 89.0f },         // not 90, so the view's up vector stays defined
+    { "bottom", 0.0f, -89.0f },
+    { "iso", 45.0f, 35.264f },      // looking down the cube diagonal
+};
+
+static const float TURNTABLE_PITCH = 20.0f;
+static const unsigned int MAX_TURNTABLE_VIEWS = 3600;
+
+bool parse_camera_presets(const std::string& spec, std::vector<camera_preset>& out) {
+    std::vector<camera_preset> views;
+    size_t pos = 0;
+    while (pos <= spec.size()) {
+        size_t comma = spec.find(',', pos);
+        if (comma == std::string::npos) comma = spec.size();
+        std::string name = spec.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        if (name.compare(0, 10, "turntable:") == 0) {
+            char* end = nullptr;
+            unsigned long n = strtoul(name.c_str() + 10, &end, 10);
+            if (*end || n == 0 || n > MAX_TURNTABLE_VIEWS) return false;
+            for (unsigned long i = 0; i < n; i++) {
+                char label[32];
+                snprintf(label, sizeof(label), "turn%03lu", i);
+                camera_preset p = { label, 360.0f * i / n, TURNTABLE_PITCH };
+                views.push_back(p);
+            }
+            continue;
+        }
+        bool found = false;
+        for (const auto& p : NAMED_PRESETS) {
+            if (name == p.name) { views.push_back(p); found = true; break; }
+        }
+        if (!found) return false;
+    }
+    out.swap(views);
+    return true;
+}
+
+// ---------------- image files ----------------
+// Pixels are RGBA rows from the bottom up, as glReadPixels returns them
+
+static bool write_ppm(const std::string& path, const uint8_t* rgba, int w, int h) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+    fprintf(f, "P6\n%d %d\n255\n", w, h);
+    std::vector<uint8_t> row(3 * w);
+    bool ok = true;
+    for (int y = h - 1; y >= 0 && ok; y--) {
+        const uint8_t* src = rgba + (size_t)4 * w * y;
+        for (int x = 0; x < w; x++) {
+            row[3*x] = src[4*x]; row[3*x+1] = src[4*x+1]; row[3*x+2] = src[4*x+2];
+        }
+        ok = fwrite(row.data(), 1, row.size(), f) == row.size();
+    }
+    return fclose(f) == 0 && ok;
+}
+
+// Uncompressed 24-bit truecolor; TGA's default origin is the bottom left,
+// so rows go out in the order they came back
+static bool write_tga(const std::string& path, const uint8_t* rgba, int w, int h) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+    uint8_t header[18];
+    memset(header, 0, sizeof(header));
+    header[2] = 2;                      // uncompressed truecolor
+    header[12] = w & 0xFF; header[13] = (w >> 8) & 0xFF;
+    header[14] = h & 0xFF; header[15] = (h >> 8) & 0xFF;
+    header[16] = 24;
+    bool ok = fwrite(header, 1, sizeof(header), f) == sizeof(header);
+    std::vector<uint8_t> row(3 * w);
+    for (int y = 0; y < h && ok; y++) {
+        const uint8_t* src = rgba + (size_t)4 * w * y;
+        for (int x = 0; x < w; x++) {
+            row[3*x] = src[4*x+2]; row[3*x+1] = src[4*x+1]; row[3*x+2] = src[4*x];
+        }
+        ok = fwrite(row.data(), 1, row.size(), f) == row.size();
+    }
+    return fclose(f) == 0 && ok;
+}
+
+// ---------------- batch rendering ----------------
+namespace {
+
+// Encode jobs on the pool. Each holds a full image, so submit() first
+// waits until fewer than max_pending are queued.
+struct encode_queue {
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t pending, written, failed;
+    size_t max_pending;
+
+    explicit encode_queue(size_t limit) : pending(0), written(0), failed(0), max_pending(limit) {}
+
+    void submit(const std::string& path, std::shared_ptr<std::vector<uint8_t> > pixels,
+                int w, int h, ImageFormat format) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this]() { return pending < max_pending; });
+            pending++;
+        }
+        thread_pool_t::instance().submit([this, path, pixels, w, h, format]() {
+            bool ok = format == IMAGE_TGA ? write_tga(path, pixels->data(), w, h)
+                                          : write_ppm(path, pixels->data(), w, h);
+            if (!ok) std::cerr << "Couldn't write " << path << "\n";
+            std::lock_guard<std::mutex> lock(mutex);
+            pending--;
+            if (ok) written++;
+            else failed++;
+            done.notify_all();
+        });
+    }
+
+    void wait_all() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]() { return pending == 0; });
+    }
+};
+
+// Color + depth renderbuffers, and the PBOs frames are read back into.
+// A frame's readback is only mapped once its fence has passed, RING - 1
+// frames later unless the ring runs dry first.
+class offscreen_target_t {
+public:
+    static const unsigned int RING = 3;
+
+    offscreen_target_t(int w, int h, ImageFormat f, encode_queue& q)
+        : width(w), height(h), format(f), encodes(q), fbo(0), color(0), depth(0), next(0) {
+        for (unsigned int i = 0; i < RING; i++) {
+            pbos[i] = 0;
+            fences[i] = 0;
+        }
+    }
+    ~offscreen_target_t() { destroy(); }
+
+    bool create() {
+        glGenFramebuffers(1, &fbo);
+        glGenRenderbuffers(1, &color);
+        glGenRenderbuffers(1, &depth);
+        glBindRenderbuffer(GL_RENDERBUFFER, color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+        bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        if (!complete) return false;
+
+        glGenBuffers(RING, pbos);
+        for (unsigned int i = 0; i < RING; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, frame_bytes(), nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glViewport(0, 0, width, height);
+        return true;
+    }
+
+    void destroy() {
+        for (unsigned int i = 0; i < RING; i++) {
+            if (fences[i]) glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+        if (pbos[0]) glDeleteBuffers(RING, pbos);
+        if (depth) glDeleteRenderbuffers(1, &depth);
+        if (color) glDeleteRenderbuffers(1, &color);
+        if (fbo) glDeleteFramebuffers(1, &fbo);
+        for (unsigned int i = 0; i < RING; i++) pbos[i] = 0;
+        fbo = color = depth = 0;
+    }
+
+    // Starts reading back what was just drawn; path is where it goes
+    void read_back(const std::string& path) {
+        unsigned int slot = next;
+        next = (next + 1) % RING;
+        if (fences[slot]) finish(slot, true);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        paths[slot] = path;
+    }
+
+    // Hands finished readbacks to the encoders; with wait, all of them
+    void collect(bool wait) {
+        for (unsigned int i = 0; i < RING; i++) {
+            unsigned int slot = (next + i) % RING;     // oldest first
+            if (fences[slot]) finish(slot, wait);
+        }
+    }
+
+private:
+    int width, height;
+    ImageFormat format;
+    encode_queue& encodes;
+    GLuint fbo, color, depth;
+    GLuint pbos[RING];
+    GLsync fences[RING];
+    std::string paths[RING];
+    unsigned int next;
+
+    size_t frame_bytes() const { return (size_t)4 * width * height; }
+
+    void finish(unsigned int slot, bool wait) {
+        GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+        for (;;) {
+            GLenum r = glClientWaitSync(fences[slot], flags, wait ? 1000000 : 0);
+            if (r == GL_ALREADY_SIGNALED || r == GL_CONDITION_SATISFIED || r == GL_WAIT_FAILED) break;
+            if (!wait) return;
+            flags = 0;
+        }
+        glDeleteSync(fences[slot]);
+        fences[slot] = 0;
+
+        std::shared_ptr<std::vector<uint8_t> > pixels(new std::vector<uint8_t>(frame_bytes()));
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+        const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame_bytes(), GL_MAP_READ_BIT);
+        if (mapped) {
+            memcpy(pixels->data(), mapped, frame_bytes());
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if (mapped) encodes.submit(paths[slot], pixels, width, height, format);
+        else std::cerr << "Couldn't map the readback for " << paths[slot] << "\n";
+    }
+};
+
+}
+
+// NAME from DIR/NAME.mod
+static std::string base_name(const std::string& file) {
+    size_t slash = file.find_last_of('/');
+    std::string name = slash == std::string::npos ? file : file.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return dot == std::string::npos || dot == 0 ? name : name.substr(0, dot);
+}
+
+// Fits the model's bounding sphere into the view from the preset direction
+static void frame_model(model_t* model, const camera_preset& p, float aspect, glm::mat4& view, glm::mat4& proj) {
+    glm::vec3 min, max;
+    glm::vec3 center(0.0f);
+    float radius = 1.0f;
+    if (model->bounds(min, max)) {
+        center = 0.5f * (min + max);
+        radius = std::max(0.5f * glm::length(max - min), 1e-3f);
+    }
+    const float fov_y = glm::radians(45.0f);
+    float half_fov = aspect < 1.0f ? atanf(tanf(0.5f * fov_y) * aspect) : 0.5f * fov_y;
+    float distance = radius / sinf(half_fov);
+
+    float yaw = glm::radians(p.yaw), pitch = glm::radians(p.pitch);
+    glm::vec3 dir(cosf(pitch) * sinf(yaw), sinf(pitch), cosf(pitch) * cosf(yaw));
+    view = glm::lookAt(center + distance * dir, center, glm::vec3(0, 1, 0));
+    float near_plane = std::max(distance - 1.01f * radius, 0.01f * distance);
+    proj = glm::perspective(fov_y, aspect, near_plane, distance + 1.01f * radius);
+}
+
+int run_batch_render(const batch_render_options& options) {
+    std::vector<camera_preset> views = options.views;
+    if (views.empty()) parse_camera_presets("iso", views);
+    if (options.files.empty()) {
+        std::cerr << "Nothing to render\n";
+        return 1;
+    }
+    // images are named after the file's base name alone, so two inputs
+    // sharing one would overwrite each other
+    std::map<std::string, std::string> names;
+    bool clash = false;
+    for (const auto& file : options.files) {
+        auto it = names.insert(std::make_pair(base_name(file), file));
+        if (!it.second) {
+            std::cerr << it.first->second << " and " << file << " would both write " << it.first->first << "_*\n";
+            clash = true;
+        }
+    }
+    if (clash) return 1;
+
+    if (!glfwInit()) {
+        std::cerr << "Failed to init GLFW\n";
+        return 1;
+    }
+    GLFWwindow* window = NULL;
+    const int versions[2][2] = { {4, 3}, {3, 3} };
+    for (int i = 0; i < 2 && !window; i++) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, versions[i][0]);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, versions[i][1]);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        window = glfwCreateWindow(64, 64, "modeler batch", NULL, NULL);
+    }
+    if (!window) {
+        std::cerr << "Failed to create a hidden GL context\n";
+        glfwTerminate();
+        return 1;
+    }
+    glfwMakeContextCurrent(window);
+    glewExperimental = GL_TRUE;
+    if (glewInit() != GLEW_OK) {
+        std::cerr << "Failed to init GLEW\n";
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return 1;
+    }
+
+    int result = 1;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    // GL objects go out of scope before the context does
+    {
+        renderer_t renderer;
+        encode_queue encodes(2 * (thread_pool_t::instance().size() + 1));
+        offscreen_target_t target(options.width, options.height, options.format, encodes);
+        if (!renderer.init() || !target.create()) {
+            std::cerr << "Failed to set up offscreen rendering\n";
+            target.destroy();
+            renderer.shutdown();
+            glfwDestroyWindow(window);
+            glfwTerminate();
+            return 1;
+        }
+        renderer.viewport_height = (float)options.height;
+        renderer.use_instancing = options.instancing;
+        renderer.use_indirect = options.indirect;
+        renderer.use_culling = options.culling;
+        renderer.use_lod = options.lod;
+        renderer.use_procedural = options.procedural;
+        glEnable(GL_DEPTH_TEST);
+        glClearColor(options.background.r, options.background.g, options.background.b, options.background.a);
+
+        size_t failed_files = 0, images = 0;
+        const char* extension = options.format == IMAGE_TGA ? ".tga" : ".ppm";
+        float aspect = (float)options.width / (float)options.height;
+        model_loader_t loader;
+        edit_journal_t journal;
+        size_t next_file = 0;
+        loader.start(options.files[next_file]);
+        while (next_file < options.files.size()) {
+            // wait for the current file; finished readbacks go out meanwhile
+            model_t* model = nullptr;
+            LoadStatus status;
+            while ((status = loader.poll(1000.0, model)) == LOAD_PENDING) {
+                target.collect(false);
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            const std::string file = options.files[next_file++];
+            // the next file parses while this one renders
+            if (next_file < options.files.size()) loader.start(options.files[next_file]);
+
+            if (status != LOAD_DONE) {
+                std::cerr << "Couldn't load " << file << "\n";
+                failed_files++;
+                continue;
+            }
+            journal.attach(model, file);     // edits saved since the last snapshot
+            journal.detach();
+
+            std::string prefix = options.output_dir + "/" + base_name(file) + "_";
+            for (const auto& v : views) {
+                glm::mat4 view, proj;
+                model->update_world_matrices();
+                frame_model(model, v, aspect, view, proj);
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                renderer.draw(model, view, proj);
+                target.read_back(prefix + v.name + extension);
+                images++;
+            }
+            delete model;
+            renderer.forget_meshes();
+        }
+        loader.shutdown();
+        target.collect(true);
+        encodes.wait_all();
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << "Rendered " << images << " images (" << encodes.written << " written) from "
+                  << options.files.size() - failed_files << " of " << options.files.size() << " files in "
+                  << seconds << " s\n";
+        result = failed_files || encodes.failed ? 1 : 0;
+    }
+
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return result;
+}
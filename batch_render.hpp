@@ -0,0 +1,46 @@
+#ifndef BATCH_RENDER_HPP
+#define BATCH_RENDER_HPP
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+enum ImageFormat { IMAGE_PPM, IMAGE_TGA };
+
+// Camera direction around the model's bounding sphere, in degrees: yaw
+// turns about +Y starting from +Z, pitch lifts toward +Y
+struct camera_preset {
+    std::string name;       // goes into the output file name
+    float yaw, pitch;
+};
+
+// Comma separated: front, back, left, right, top, bottom, iso, or
+// turntable:N for N views evenly spaced around the model. False (and
+// out unchanged) on an unknown name.
+bool parse_camera_presets(const std::string& spec, std::vector<camera_preset>& out);
+
+struct batch_render_options {
+    std::vector<std::string> files;     // .mod / .modb
+    std::vector<camera_preset> views;   // "iso" if empty
+    std::string output_dir;             // must exist
+    int width, height;
+    ImageFormat format;
+    glm::vec4 background;
+    // renderer_t's use_* switches, same defaults
+    bool instancing, indirect, culling, lod, procedural;
+
+    batch_render_options()
+        : output_dir("."), width(256), height(256), format(IMAGE_PPM), background(0.1f, 0.12f, 0.15f, 1.0f),
+          instancing(true), indirect(true), culling(true), lod(false), procedural(false) {}
+};
+
+// Renders every view of every file offscreen and writes
+// OUTPUT_DIR/NAME_VIEW.ppm (or .tga). Creates its own hidden GL context.
+// Three stages overlap: the next file parses on the loader thread while
+// the current one renders into an FBO, readbacks go through a ring of PBOs
+// so the GPU never waits, and images are encoded on the thread pool.
+// Returns the process exit code: 0 if every image was written, 1
+// without rendering anything if two files share a base name.
+int run_batch_render(const batch_render_options& options);
+
+#endif // BATCH_RENDER_HPP
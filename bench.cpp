@@ -0,0 +1,424 @@
+// Headless benchmarks for the modeler's hot paths.
+// Build and run with: make bench
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "model.hpp"
+#include "shape.hpp"
+#include "renderer.hpp"
+#include "bvh.hpp"
+#include "shader.hpp"
+
+using namespace std;
+
+typedef chrono::steady_clock bench_clock;
+
+// resident set size in MiB, from /proc/self/statm
+static double rss_mib() {
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return 0.0;
+    long pages = 0, resident = 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * (double)sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+static double peak_rss_mib() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss / 1024.0;  // kilobytes on Linux
+}
+
+static void report(const string& name, size_t ops, double seconds) {
+    double ns = ops ? seconds * 1e9 / ops : 0.0;
+    printf("%-44s %10zu ops %14.1f ns/op %9.1f MiB rss\n", name.c_str(), ops, ns, rss_mib());
+}
+
+// time f() once and report it as `ops` operations
+template <typename F>
+static void bench(const string& name, size_t ops, F f) {
+    bench_clock::time_point t0 = bench_clock::now();
+    f();
+    double s = chrono::duration<double>(bench_clock::now() - t0).count();
+    report(name, ops, s);
+}
+
+// ---------------- synthetic scenes ----------------
+
+static model_node* add_shape(model_t& m, int type, unsigned int level, model_node* parent) {
+    switch (type % 4) {
+        case 0: return m.create_sphere(level, parent);
+        case 1: return m.create_cylinder(level, parent);
+        case 2: return m.create_box(parent);
+        default: return m.create_cone(level, parent);
+    }
+}
+
+static void place(model_node* n, size_t i) {
+    float x = (float)(i % 100) - 50.0f;
+    float y = (float)((i / 100) % 100) - 50.0f;
+    n->translation = glm::vec3(x * 0.05f, y * 0.05f, 0.0f);
+    n->mark_dirty();
+}
+
+// every node a direct child of the root
+static void build_wide(model_t& m, size_t n, unsigned int level) {
+    for (size_t i = 0; i < n; i++) place(add_shape(m, (int)i, level, m.root), i);
+}
+
+// one chain, each node the child of the previous one
+static void build_deep(model_t& m, size_t n, unsigned int level) {
+    model_node* parent = m.root;
+    for (size_t i = 0; i < n; i++) {
+        parent = add_shape(m, (int)i, level, parent);
+        parent->translation = glm::vec3(0.001f, 0.0f, 0.0f);
+        parent->mark_dirty();
+    }
+}
+
+// random parents and mixed primitives
+static void build_mixed(model_t& m, size_t n, unsigned int level) {
+    srand(12345);
+    vector<model_node*> nodes;
+    nodes.push_back(m.root);
+    for (size_t i = 0; i < n; i++) {
+        model_node* parent = nodes[rand() % nodes.size()];
+        model_node* c = add_shape(m, rand(), level, parent);
+        place(c, i);
+        nodes.push_back(c);
+    }
+}
+
+typedef void (*scene_builder)(model_t&, size_t, unsigned int);
+
+struct scene_kind {
+    const char* name;
+    scene_builder build;
+    size_t nodes;
+};
+
+// ---------------- benchmarks ----------------
+
+static void bench_shape_generation() {
+    const size_t reps = 20;
+    for (unsigned int level = 0; level <= MAX_TESS_LEVEL; level++) {
+        char name[64];
+        snprintf(name, sizeof(name), "generate sphere level %u", level);
+        bench(name, reps, [&]() { for (size_t i = 0; i < reps; i++) { sphere_t s(level); } });
+        snprintf(name, sizeof(name), "generate cylinder level %u", level);
+        bench(name, reps, [&]() { for (size_t i = 0; i < reps; i++) { cylinder_t s(level); } });
+        snprintf(name, sizeof(name), "generate cone level %u", level);
+        bench(name, reps, [&]() { for (size_t i = 0; i < reps; i++) { cone_t s(level); } });
+    }
+    bench("generate box", reps, [&]() { for (size_t i = 0; i < reps; i++) { box_t s; } });
+}
+
+static void bench_scene(const scene_kind& kind, unsigned int level, renderer_t& renderer) {
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "%s/%zu L%u ", kind.name, kind.nodes, level);
+    string p(prefix);
+
+    model_t* m = new model_t();
+    bench(p + "build", kind.nodes, [&]() { kind.build(*m, kind.nodes, level); });
+
+    bench(p + "world update (all dirty)", kind.nodes, [&]() { m->update_world_matrices(); });
+    const size_t passes = 20;
+    bench(p + "world update (clean)", passes, [&]() {
+        for (size_t i = 0; i < passes; i++) m->update_world_matrices();
+    });
+    // the root edit forces every node to refresh: serial recursion vs the
+    // level-by-level pool update (which only kicks in for large models)
+    for (int parallel = 0; parallel < 2; parallel++) {
+        m->parallel_update = parallel != 0;
+        bench(p + (parallel ? "world update (root edited, parallel)" : "world update (root edited, serial)"),
+              passes * kind.nodes, [&]() {
+            for (size_t i = 0; i < passes; i++) {
+                m->root->mark_dirty();
+                m->update_world_matrices();
+            }
+        });
+    }
+    m->parallel_update = true;
+
+    // read every cached world matrix, as draw and centroid code do
+    volatile float sink = 0.0f;
+    bench(p + "get_world_matrix", passes * kind.nodes, [&]() {
+        for (size_t i = 0; i < passes; i++)
+            for (auto n : m->all_nodes) sink = sink + n->get_world_matrix()[3][0];
+    });
+
+    vector<model_node*> out;
+    bench(p + "collect", passes * kind.nodes, [&]() {
+        for (size_t i = 0; i < passes; i++) {
+            out.clear();
+            m->root->collect(out);
+        }
+    });
+    m->flat_nodes();
+    bench(p + "flat_nodes (cached)", passes * kind.nodes, [&]() {
+        for (size_t i = 0; i < passes; i++) sink = sink + (float)m->flat_nodes().size();
+    });
+
+    // picking: rays from the camera position through random nodes
+    scene_bvh_t bvh;
+    bench(p + "bvh build", kind.nodes, [&]() { bvh.sync(m); });
+    const size_t rays = 1000;
+    glm::vec3 eye(0.0f, 0.0f, 8.0f);
+    srand(1);
+    bench(p + "bvh raycast", rays, [&]() {
+        for (size_t i = 0; i < rays; i++) {
+            model_node* target = m->all_nodes[rand() % m->all_nodes.size()];
+            glm::vec3 c = 0.5f * (target->bounds_min + target->bounds_max);
+            if (bvh.raycast(m, eye, c - eye)) sink = sink + 1.0f;
+        }
+    });
+    bench(p + "bvh refit (root edited)", passes, [&]() {
+        for (size_t i = 0; i < passes; i++) {
+            m->root->mark_dirty();
+            bvh.sync(m);
+        }
+    });
+
+    // draw with the whole scene in view; glFinish so GPU time is included
+    glm::mat4 view = glm::lookAt(glm::vec3(0, 0, 8), glm::vec3(0), glm::vec3(0, 1, 0));
+    glm::mat4 proj = glm::perspective(glm::radians(60.0f), 4.0f / 3.0f, 0.1f, 100.0f);
+    const size_t frames = 10;
+    struct { const char* name; bool instancing, indirect, procedural; } modes[4] = {
+        { "draw direct (frame)", false, false, false },
+        { "draw instanced (frame)", true, false, false },
+        { "draw multi-draw indirect (frame)", true, true, false },
+        { "draw procedural (frame)", true, false, true },
+    };
+    for (int k = 0; k < 4; k++) {
+        if (modes[k].indirect && !renderer.indirect_available()) continue;
+        renderer.use_procedural = modes[k].procedural;
+        renderer.use_instancing = modes[k].instancing;
+        renderer.use_indirect = modes[k].indirect;
+        renderer.draw(m, view, proj);  // warm up
+        glFinish();
+        bench(p + modes[k].name, frames, [&]() {
+            for (size_t i = 0; i < frames; i++) {
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                renderer.draw(m, view, proj);
+            }
+            glFinish();
+        });
+    }
+
+    // the whole model frozen into one mesh: one draw per frame
+    renderer.use_procedural = false;
+    renderer.use_instancing = true;
+    renderer.use_indirect = true;
+    bench(p + "freeze (whole model)", kind.nodes, [&]() { m->freeze(m->root); });
+    renderer.draw(m, view, proj);
+    glFinish();
+    bench(p + "draw frozen (frame)", frames, [&]() {
+        for (size_t i = 0; i < frames; i++) {
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            renderer.draw(m, view, proj);
+        }
+        glFinish();
+    });
+    m->unfreeze(m->root);
+
+    const char* files[2] = { "bench_tmp.mod", "bench_tmp.modb" };
+    for (int k = 0; k < 2; k++) {
+        string fmt = k ? "binary " : "text ";
+        bench(p + "save " + fmt, kind.nodes, [&]() { m->save_to_file(files[k]); });
+        model_t* loaded = new model_t();
+        bench(p + "load " + fmt, kind.nodes, [&]() { loaded->load_from_file(files[k]); });
+        delete loaded;
+        remove(files[k]);
+    }
+
+    // remove leaves first so every call is a single node
+    bench(p + "remove_node (one by one)", kind.nodes, [&]() {
+        while (m->last_created() && m->last_created() != m->root) m->remove_node(m->last_created());
+    });
+
+    delete m;
+    renderer.forget_meshes();
+}
+
+// Same scene drawn with each vertex format; the heaviest level makes vertex
+// fetch matter most
+static void bench_vertex_formats(renderer_t& renderer) {
+    glm::mat4 view = glm::lookAt(glm::vec3(0, 0, 8), glm::vec3(0), glm::vec3(0, 1, 0));
+    glm::mat4 proj = glm::perspective(glm::radians(60.0f), 4.0f / 3.0f, 0.1f, 100.0f);
+    const size_t frames = 10;
+    for (int f = 0; f < NUM_VERTEX_FORMATS; f++) {
+        // the scene starts from an empty cache, so every mesh uses the new format
+        shape_cache_t::instance().set_vertex_format((VertexFormat)f);
+        model_t* m = new model_t();
+        build_mixed(*m, 10000, MAX_TESS_LEVEL);
+
+        size_t vertex_bytes = 0;
+        for (auto n : m->all_nodes) {
+            if (n->shape) vertex_bytes += n->shape->vertex_count * vertex_format_stride(n->shape->vertex_format);
+        }
+        string p = string("vertex format ") + vertex_format_name((VertexFormat)f) + " ";
+        printf("%-44s %zu bytes/vertex, %.1f KB of vertex data per scene pass\n", (p + "size").c_str(),
+               vertex_format_stride((VertexFormat)f), vertex_bytes / 1024.0);
+
+        for (int indirect = 0; indirect < 2; indirect++) {
+            if (indirect && !renderer.indirect_available()) continue;
+            renderer.use_instancing = true;
+            renderer.use_indirect = indirect != 0;
+            renderer.draw(m, view, proj);  // warm up
+            glFinish();
+            bench(p + (indirect ? "draw multi-draw indirect (frame)" : "draw instanced (frame)"), frames, [&]() {
+                for (size_t i = 0; i < frames; i++) {
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                    renderer.draw(m, view, proj);
+                }
+                glFinish();
+            });
+        }
+        delete m;
+        renderer.forget_meshes();
+    }
+    shape_cache_t::instance().set_vertex_format(VERTEX_FLOAT3);
+}
+
+// What batch rendering does: load a file, draw a few views through the
+// indirect path, delete the model, next file. Each file uses other levels
+// and another vertex format, so the last file's meshes are freed and the
+// shared buffers have to be repacked.
+static void bench_file_sequence(renderer_t& renderer) {
+    if (!renderer.indirect_available()) return;
+    const size_t files = 8, nodes = 2000, views = 4;
+    vector<string> names;
+    for (size_t i = 0; i < files; i++) {
+        model_t m;
+        build_wide(m, nodes, (unsigned int)(i % (MAX_TESS_LEVEL + 1)));
+        names.push_back("bench_seq_" + to_string(i) + ".mod");
+        m.save_to_file(names.back());
+    }
+
+    glm::mat4 proj = glm::perspective(glm::radians(60.0f), 4.0f / 3.0f, 0.1f, 100.0f);
+    renderer.use_procedural = false;
+    renderer.use_instancing = true;
+    renderer.use_indirect = true;
+    bench("files in a row, multi-draw indirect (view)", files * views, [&]() {
+        for (size_t i = 0; i < files; i++) {
+            shape_cache_t::instance().set_vertex_format((VertexFormat)(i % NUM_VERTEX_FORMATS));
+            model_t* m = new model_t();
+            m->load_from_file(names[i]);
+            for (size_t v = 0; v < views; v++) {
+                glm::mat4 view = glm::lookAt(glm::vec3(2.0f * v, 0, 8), glm::vec3(0), glm::vec3(0, 1, 0));
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                renderer.draw(m, view, proj);
+            }
+            delete m;
+            renderer.forget_meshes();
+        }
+        glFinish();
+    });
+    shape_cache_t::instance().set_vertex_format(VERTEX_FLOAT3);
+    for (const auto& name : names) remove(name.c_str());
+}
+
+// Startup cost of the renderer's programs: compiled from source vs loaded
+// from the binary cache (warmed by the first pass)
+static void bench_shader_startup() {
+    shader_manager_t& shaders = shader_manager_t::instance();
+    const size_t reps = 5;
+    for (int cached = 0; cached < 2; cached++) {
+        shaders.set_cache_dir(cached ? "shader_cache" : "");
+        if (cached) { renderer_t warm; warm.init(); }
+        bench(cached ? "renderer init (binary cache)" : "renderer init (compile)", reps, [&]() {
+            for (size_t i = 0; i < reps; i++) {
+                renderer_t r;
+                r.init();
+                glFinish();     // drivers may compile lazily
+            }
+        });
+    }
+    printf("%-44s %u from cache, %u compiled\n", "shader programs", shaders.cache_hits(), shaders.compiled());
+}
+
+int main(int argc, char** argv) {
+    (void)argc; (void)argv;
+    if (!glfwInit()) {
+        fprintf(stderr, "Failed to init GLFW\n");
+        return 1;
+    }
+
+    // 4.3 for the multi-draw indirect numbers, 3.3 otherwise
+    GLFWwindow* window = NULL;
+    const int versions[2][2] = { {4, 3}, {3, 3} };
+    for (int i = 0; i < 2 && !window; i++) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, versions[i][0]);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, versions[i][1]);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        window = glfwCreateWindow(800, 600, "modeler bench", NULL, NULL);
+    }
+    if (!window) {
+        fprintf(stderr, "Failed to create hidden GLFW window\n");
+        glfwTerminate();
+        return 1;
+    }
+    glfwMakeContextCurrent(window);
+    glfwSwapInterval(0);
+
+    glewExperimental = GL_TRUE;
+    if (glewInit() != GLEW_OK) {
+        fprintf(stderr, "Failed to init GLEW\n");
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return 1;
+    }
+    glViewport(0, 0, 800, 600);
+    glEnable(GL_DEPTH_TEST);
+
+    renderer_t renderer;
+    if (!renderer.init()) {
+        fprintf(stderr, "Failed to init renderer\n");
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return 1;
+    }
+    renderer.viewport_height = 600.0f;
+
+    printf("GL %s, %s\n\n", (const char*)glGetString(GL_VERSION), (const char*)glGetString(GL_RENDERER));
+
+    bench_shape_generation();
+    printf("\n");
+    bench_shader_startup();
+    printf("\n");
+
+    const scene_kind kinds[] = {
+        { "wide", build_wide, 10000 },
+        { "deep", build_deep, 2000 },
+        { "mixed", build_mixed, 10000 },
+    };
+    for (const auto& kind : kinds) {
+        for (unsigned int level = 0; level <= MAX_TESS_LEVEL; level++) {
+            bench_scene(kind, level, renderer);
+        }
+        printf("\n");
+    }
+
+    bench_vertex_formats(renderer);
+    printf("\n");
+    bench_file_sequence(renderer);
+    printf("\n");
+
+    printf("peak rss %.1f MiB\n", peak_rss_mib());
+
+    renderer.shutdown();
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return 0;
+}
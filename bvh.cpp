@@ -0,0 +1,391 @@
+#include "bvh.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+// ---------------- geometry tests ----------------
+// Slab test against [tmin 0, tmax]; tnear is where the ray enters
+static bool ray_box(const glm::vec3& o, const glm::vec3& inv_d, const glm::vec3& mn, const glm::vec3& mx,
+                    float tmax, float& tnear) {
+    glm::vec3 t0 = (mn - o) * inv_d;
+    glm::vec3 t1 = (mx - o) * inv_d;
+    glm::vec3 ts = glm::min(t0, t1);
+    glm::vec3 tb = glm::max(t0, t1);
+    float tn = std::max(std::max(ts.x, ts.y), std::max(ts.z, 0.0f));
+    float tf = std::min(std::min(tb.x, tb.y), std::min(tb.z, tmax));
+    tnear = tn;
+    return tn <= tf;
+}
+
+// Moller-Trumbore, both faces
+static bool ray_triangle(const glm::vec3& o, const glm::vec3& d,
+                         const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, float& t) {
+    glm::vec3 e1 = b - a, e2 = c - a;
+    glm::vec3 p = glm::cross(d, e2);
+    float det = glm::dot(e1, p);
+    if (std::fabs(det) < 1e-12f) return false;
+    float inv = 1.0f / det;
+    glm::vec3 s = o - a;
+    float u = glm::dot(s, p) * inv;
+    if (u < 0.0f || u > 1.0f) return false;
+    glm::vec3 q = glm::cross(s, e1);
+    float v = glm::dot(d, q) * inv;
+    if (v < 0.0f || u + v > 1.0f) return false;
+    t = glm::dot(e2, q) * inv;
+    return t >= 0.0f;
+}
+
+static bool boxes_overlap(const glm::vec3& amin, const glm::vec3& amax, const glm::vec3& bmin, const glm::vec3& bmax) {
+    return amin.x <= bmax.x && amax.x >= bmin.x && amin.y <= bmax.y && amax.y >= bmin.y
+        && amin.z <= bmax.z && amax.z >= bmin.z;
+}
+
+static float box_distance2(const glm::vec3& mn, const glm::vec3& mx, const glm::vec3& p) {
+    glm::vec3 d = p - glm::clamp(p, mn, mx);
+    return glm::dot(d, d);
+}
+
+// Separating axis test of a triangle against a box given by center and
+// half extents (Akenine-Moller): box normals, triangle normal, and the
+// nine edge cross products
+static bool triangle_box_overlap(const glm::vec3& center, const glm::vec3& half,
+                                 const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+    glm::vec3 v[3] = { a - center, b - center, c - center };
+    for (int k = 0; k < 3; k++) {
+        float lo = std::min(std::min(v[0][k], v[1][k]), v[2][k]);
+        float hi = std::max(std::max(v[0][k], v[1][k]), v[2][k]);
+        if (lo > half[k] || hi < -half[k]) return false;
+    }
+
+    glm::vec3 e[3] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
+    glm::vec3 n = glm::cross(e[0], e[1]);
+    if (std::fabs(glm::dot(n, v[0])) > glm::dot(half, glm::abs(n))) return false;
+
+    for (int i = 0; i < 3; i++) {
+        glm::vec3 u(0.0f);
+        u[i] = 1.0f;
+        for (int j = 0; j < 3; j++) {
+            glm::vec3 axis = glm::cross(u, e[j]);
+            float p0 = glm::dot(axis, v[0]), p1 = glm::dot(axis, v[1]), p2 = glm::dot(axis, v[2]);
+            float r = glm::dot(half, glm::abs(axis));
+            if (std::min(std::min(p0, p1), p2) > r || std::max(std::max(p0, p1), p2) < -r) return false;
+        }
+    }
+    return true;
+}
+
+// Ericson, Real-Time Collision Detection 5.1.5
+static glm::vec3 closest_on_triangle(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+    glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+    glm::vec3 bp = p - b;
+    float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3) return b;
+
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+
+    glm::vec3 cp = p - c;
+    float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6) return c;
+
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+    float denom = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// The ray in the node's local space, where the mesh can be tested as is;
+// t keeps its meaning because the direction isn't renormalized
+static bool ray_mesh(const model_node* n, const glm::vec3& o, const glm::vec3& d, float tmax, float& t) {
+    const glm::mat4& w = n->get_world_matrix();
+    if (std::fabs(glm::determinant(w)) < 1e-18f) return false;     // flattened to nothing
+    glm::mat4 inv = glm::inverse(w);
+    glm::vec3 lo(inv * glm::vec4(o, 1.0f));
+    glm::vec3 ld(inv * glm::vec4(d, 0.0f));
+
+    const shape_t* s = n->shape;
+    float tn;
+    if (!ray_box(lo, 1.0f / ld, s->bounds_min, s->bounds_max, tmax, tn)) return false;
+    if (!s->has_cpu_data()) {
+        t = tn;
+        return true;
+    }
+
+    bool found = false;
+    const std::vector<glm::vec3>& v = s->vertices;
+    const std::vector<GLuint>& idx = s->indices;
+    for (size_t k = 0; k + 2 < idx.size(); k += 3) {
+        float tt;
+        if (ray_triangle(lo, ld, v[idx[k]], v[idx[k + 1]], v[idx[k + 2]], tt) && tt < tmax) {
+            tmax = tt;
+            found = true;
+        }
+    }
+    if (found) t = tmax;
+    return found;
+}
+
+// ---------------- scene_bvh_t ----------------
+scene_bvh_t::scene_bvh_t() : model(nullptr), structure_stamp(0), world_stamp(0) {}
+
+void scene_bvh_t::clear() {
+    model = nullptr;
+    structure_stamp = world_stamp = 0;
+    nodes.clear();
+    parent.clear();
+    items.clear();
+    item_min.clear();
+    item_max.clear();
+    leaf_of.clear();
+    stale.clear();
+}
+
+void scene_bvh_t::sync(model_t* m) {
+    if (!m) {
+        clear();
+        return;
+    }
+    m->update_world_matrices();
+    uint64_t s = m->structure_stamp(), w = m->world_stamp();
+    if (m != model || s != structure_stamp) {
+        model = m;
+        build();
+    } else if (w != world_stamp) {
+        refit();
+    }
+    structure_stamp = s;
+    world_stamp = w;
+}
+
+// Top-down median split on the longest axis of the box centers
+void scene_bvh_t::build() {
+    nodes.clear();
+    parent.clear();
+    items.clear();
+    item_min.clear();
+    item_max.clear();
+    for (auto n : model->all_nodes) {
+        if (!n->shape || n->bounds_min.x > n->bounds_max.x) continue;
+        items.push_back(n);
+        item_min.push_back(n->bounds_min);
+        item_max.push_back(n->bounds_max);
+    }
+    leaf_of.assign(items.size(), 0);
+    if (items.empty()) {
+        stale.clear();
+        return;
+    }
+
+    size_t count = items.size();
+    std::vector<glm::vec3> centers(count);
+    std::vector<uint32_t> order(count);
+    for (size_t i = 0; i < count; i++) {
+        centers[i] = 0.5f * (item_min[i] + item_max[i]);
+        order[i] = (uint32_t)i;
+    }
+    nodes.reserve(2 * (count / LEAF_SIZE + 1) * 2);
+    parent.reserve(nodes.capacity());
+    nodes.push_back(bvh_node());
+    parent.push_back(0);
+    build_range(0, 0, (uint32_t)count, centers, order);
+
+    // store items in leaf order so each leaf's range is contiguous
+    std::vector<model_node*> sorted_items(count);
+    std::vector<glm::vec3> sorted_min(count), sorted_max(count);
+    for (size_t i = 0; i < count; i++) {
+        sorted_items[i] = items[order[i]];
+        sorted_min[i] = item_min[order[i]];
+        sorted_max[i] = item_max[order[i]];
+    }
+    items.swap(sorted_items);
+    item_min.swap(sorted_min);
+    item_max.swap(sorted_max);
+
+    for (uint32_t b = 0; b < nodes.size(); b++) {
+        for (uint32_t i = nodes[b].first, end = i + nodes[b].count; i < end; i++) leaf_of[i] = b;
+    }
+    stale.assign(nodes.size(), 0);
+}
+
+void scene_bvh_t::build_range(uint32_t index, uint32_t begin, uint32_t end,
+                              const std::vector<glm::vec3>& centers, std::vector<uint32_t>& order) {
+    glm::vec3 mn(FLT_MAX), mx(-FLT_MAX), cmin(FLT_MAX), cmax(-FLT_MAX);
+    for (uint32_t i = begin; i < end; i++) {
+        uint32_t k = order[i];
+        mn = glm::min(mn, item_min[k]);
+        mx = glm::max(mx, item_max[k]);
+        cmin = glm::min(cmin, centers[k]);
+        cmax = glm::max(cmax, centers[k]);
+    }
+    nodes[index].min = mn;
+    nodes[index].max = mx;
+    if (end - begin <= LEAF_SIZE) {
+        nodes[index].first = begin;
+        nodes[index].count = end - begin;
+        return;
+    }
+
+    glm::vec3 extent = cmax - cmin;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    uint32_t mid = begin + (end - begin) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                     [&](uint32_t a, uint32_t b) { return centers[a][axis] < centers[b][axis]; });
+
+    uint32_t child = (uint32_t)nodes.size();
+    nodes.push_back(bvh_node());
+    nodes.push_back(bvh_node());
+    parent.push_back(index);
+    parent.push_back(index);
+    nodes[index].first = child;
+    nodes[index].count = 0;
+    build_range(child, begin, mid, centers, order);
+    build_range(child + 1, mid, end, centers, order);
+}
+
+// Only leaves whose boxes moved, and their ancestors, are refitted.
+// Children follow their parents in the array, so one backward sweep
+// refits bottom-up.
+void scene_bvh_t::refit() {
+    bool any = false;
+    for (size_t i = 0; i < items.size(); i++) {
+        const model_node* n = items[i];
+        if (n->bounds_min == item_min[i] && n->bounds_max == item_max[i]) continue;
+        item_min[i] = n->bounds_min;
+        item_max[i] = n->bounds_max;
+        for (uint32_t b = leaf_of[i]; !stale[b]; b = parent[b]) {
+            stale[b] = 1;
+            if (b == 0) break;
+        }
+        any = true;
+    }
+    if (!any) return;
+    for (size_t b = nodes.size(); b-- > 0; ) {
+        if (!stale[b]) continue;
+        fit((uint32_t)b);
+        stale[b] = 0;
+    }
+}
+
+void scene_bvh_t::fit(uint32_t index) {
+    bvh_node& b = nodes[index];
+    if (b.count) {
+        b.min = glm::vec3(FLT_MAX);
+        b.max = glm::vec3(-FLT_MAX);
+        for (uint32_t i = b.first; i < b.first + b.count; i++) {
+            b.min = glm::min(b.min, item_min[i]);
+            b.max = glm::max(b.max, item_max[i]);
+        }
+    } else {
+        b.min = glm::min(nodes[b.first].min, nodes[b.first + 1].min);
+        b.max = glm::max(nodes[b.first].max, nodes[b.first + 1].max);
+    }
+}
+
+model_node* scene_bvh_t::raycast(model_t* m, const glm::vec3& origin, const glm::vec3& dir, float* t_hit) {
+    sync(m);
+    if (nodes.empty()) return nullptr;
+
+    glm::vec3 inv_d = 1.0f / dir;
+    float best = FLT_MAX;
+    model_node* hit = nullptr;
+    stack.clear();
+    stack.push_back(0);
+    while (!stack.empty()) {
+        const bvh_node& b = nodes[stack.back()];
+        stack.pop_back();
+        float tn;
+        if (!ray_box(origin, inv_d, b.min, b.max, best, tn)) continue;
+
+        if (b.count) {
+            for (uint32_t i = b.first; i < b.first + b.count; i++) {
+                float t;
+                if (!ray_box(origin, inv_d, item_min[i], item_max[i], best, tn)) continue;
+                if (ray_mesh(items[i], origin, dir, best, t)) {
+                    best = t;
+                    hit = items[i];
+                }
+            }
+            continue;
+        }
+        // nearer child on top, so its hits can prune the farther one
+        float t0 = FLT_MAX, t1 = FLT_MAX;
+        bool h0 = ray_box(origin, inv_d, nodes[b.first].min, nodes[b.first].max, best, t0);
+        bool h1 = ray_box(origin, inv_d, nodes[b.first + 1].min, nodes[b.first + 1].max, best, t1);
+        uint32_t near_child = t0 <= t1 ? b.first : b.first + 1;
+        uint32_t far_child = t0 <= t1 ? b.first + 1 : b.first;
+        bool near_hit = t0 <= t1 ? h0 : h1, far_hit = t0 <= t1 ? h1 : h0;
+        if (far_hit) stack.push_back(far_child);
+        if (near_hit) stack.push_back(near_child);
+    }
+    if (hit && t_hit) *t_hit = best;
+    return hit;
+}
+
+template <typename BoxTest, typename MeshTest>
+void scene_bvh_t::overlap(const BoxTest& box_test, const MeshTest& mesh_test, std::vector<model_node*>& out) {
+    out.clear();
+    if (nodes.empty()) return;
+    stack.clear();
+    stack.push_back(0);
+    while (!stack.empty()) {
+        const bvh_node& b = nodes[stack.back()];
+        stack.pop_back();
+        if (!box_test(b.min, b.max)) continue;
+        if (!b.count) {
+            stack.push_back(b.first + 1);
+            stack.push_back(b.first);
+            continue;
+        }
+        for (uint32_t i = b.first; i < b.first + b.count; i++) {
+            if (box_test(item_min[i], item_max[i]) && mesh_test(items[i])) out.push_back(items[i]);
+        }
+    }
+}
+
+const std::vector<glm::vec3>& scene_bvh_t::to_world(const model_node* n) {
+    const glm::mat4& w = n->get_world_matrix();
+    const std::vector<glm::vec3>& v = n->shape->vertices;
+    world_vertices.resize(v.size());
+    for (size_t i = 0; i < v.size(); i++) world_vertices[i] = glm::vec3(w * glm::vec4(v[i], 1.0f));
+    return world_vertices;
+}
+
+void scene_bvh_t::overlap_box(model_t* m, const glm::vec3& min, const glm::vec3& max, std::vector<model_node*>& out) {
+    sync(m);
+    glm::vec3 center = 0.5f * (min + max), half = 0.5f * (max - min);
+    overlap([&](const glm::vec3& bmin, const glm::vec3& bmax) { return boxes_overlap(min, max, bmin, bmax); },
+            [&](const model_node* n) {
+                if (!n->shape->has_cpu_data()) return true;    // the world box already overlaps
+                const std::vector<glm::vec3>& v = to_world(n);
+                const std::vector<GLuint>& idx = n->shape->indices;
+                for (size_t k = 0; k + 2 < idx.size(); k += 3) {
+                    if (triangle_box_overlap(center, half, v[idx[k]], v[idx[k + 1]], v[idx[k + 2]])) return true;
+                }
+                return false;
+            }, out);
+}
+
+void scene_bvh_t::overlap_sphere(model_t* m, const glm::vec3& center, float radius, std::vector<model_node*>& out) {
+    sync(m);
+    float r2 = radius * radius;
+    overlap([&](const glm::vec3& bmin, const glm::vec3& bmax) { return box_distance2(bmin, bmax, center) <= r2; },
+            [&](const model_node* n) {
+                if (!n->shape->has_cpu_data()) return true;
+                const std::vector<glm::vec3>& v = to_world(n);
+                const std::vector<GLuint>& idx = n->shape->indices;
+                for (size_t k = 0; k + 2 < idx.size(); k += 3) {
+                    glm::vec3 p = closest_on_triangle(center, v[idx[k]], v[idx[k + 1]], v[idx[k + 2]]);
+                    glm::vec3 d = p - center;
+                    if (glm::dot(d, d) <= r2) return true;
+                }
+                return false;
+            }, out);
+}
@@ -0,0 +1,68 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "model.hpp"
+
+// Bounding volume hierarchy over the world-space boxes of a model's shaped
+// nodes, for picking and proximity queries. The tree is only a filter:
+// nodes that survive it are tested against their actual mesh triangles.
+// Meshes whose CPU copy was released fall back to their bounding box.
+//
+// Every query first syncs with the model. Added or removed nodes mean a
+// rebuild. Moved nodes only refit: changed leaves and their ancestors get
+// new boxes and the tree shape stays.
+class scene_bvh_t {
+public:
+    static const unsigned int LEAF_SIZE = 4;    // nodes per leaf, at most
+
+    scene_bvh_t();
+
+    void clear();
+    // Queries call this; calling it up front moves a rebuild out of the
+    // first query
+    void sync(model_t* model);
+
+    // Nearest node whose mesh the ray origin + t * dir (t >= 0) hits, or
+    // null. dir needn't be normalized; t_hit is in units of dir.
+    model_node* raycast(model_t* model, const glm::vec3& origin, const glm::vec3& dir, float* t_hit = nullptr);
+    // Replaces out with the nodes whose mesh surface touches the box or sphere
+    void overlap_box(model_t* model, const glm::vec3& min, const glm::vec3& max, std::vector<model_node*>& out);
+    void overlap_sphere(model_t* model, const glm::vec3& center, float radius, std::vector<model_node*>& out);
+
+    size_t size() const { return items.size(); }
+
+private:
+    // Leaves have count > 0 and hold items [first, first + count);
+    // internal nodes have their two children at first and first + 1, so
+    // children always come after their parent
+    struct bvh_node {
+        glm::vec3 min;
+        uint32_t first;
+        glm::vec3 max;
+        uint32_t count;
+    };
+
+    model_t* model;
+    uint64_t structure_stamp, world_stamp;     // of model, when last synced
+    std::vector<bvh_node> nodes;
+    std::vector<uint32_t> parent;               // per bvh node, root's is itself
+    std::vector<model_node*> items;             // grouped by leaf
+    std::vector<glm::vec3> item_min, item_max;  // boxes the tree was fitted to
+    std::vector<uint32_t> leaf_of;              // per item
+    std::vector<uint8_t> stale;                 // per bvh node, during refit
+    std::vector<uint32_t> stack;                // traversal, reused
+    std::vector<glm::vec3> world_vertices;      // overlap tests, reused
+
+    void build();
+    void build_range(uint32_t index, uint32_t begin, uint32_t end,
+                     const std::vector<glm::vec3>& centers, std::vector<uint32_t>& order);
+    void refit();
+    void fit(uint32_t index);
+    template <typename BoxTest, typename MeshTest>
+    void overlap(const BoxTest& box_test, const MeshTest& mesh_test, std::vector<model_node*>& out);
+    const std::vector<glm::vec3>& to_world(const model_node* n);
+};
+
+#endif // BVH_HPP
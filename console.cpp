@@ -0,0 +1,123 @@
+#include "console.hpp"
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <poll.h>
+#include <unistd.h>
+
+// nested "source" lines past this depth are refused (likely a loop)
+static const unsigned int MAX_SCRIPT_DEPTH = 8;
+static const int STDIN_POLL_MS = 100;   // how quickly stop() is noticed
+
+static void split_words(const std::string& text, std::vector<std::string>& words) {
+    size_t i = 0, n = text.size();
+    while (i < n) {
+        while (i < n && isspace((unsigned char)text[i])) i++;
+        if (i == n || text[i] == '#') break;   // rest of the line is a comment
+        std::string w;
+        if (text[i] == '"') {
+            size_t end = text.find('"', ++i);
+            if (end == std::string::npos) end = n;
+            w = text.substr(i, end - i);
+            i = end < n ? end + 1 : n;
+        } else {
+            while (i < n && !isspace((unsigned char)text[i])) w += text[i++];
+        }
+        words.push_back(w);
+    }
+}
+
+console_t::console_t() : stopping(false) {}
+
+console_t::~console_t() {
+    stop();
+}
+
+void console_t::start(const std::vector<std::string>& scripts, std::function<void()> wake_fn) {
+    if (reader.joinable()) return;
+    wake = wake_fn;
+    stopping = false;
+    reader = std::thread(&console_t::read_loop, this, scripts);
+}
+
+void console_t::stop() {
+    stopping = true;
+    if (reader.joinable()) reader.join();
+}
+
+void console_t::push(console_command&& cmd) {
+    // a full queue means the render loop is behind; wait for it rather than drop input
+    while (!queue.push(std::move(cmd))) {
+        if (stopping) return;
+        if (wake) wake();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void console_t::handle_line(const std::string& text, const std::string& source, unsigned int line,
+                            unsigned int depth) {
+    console_command cmd;
+    split_words(text, cmd.words);
+    if (cmd.words.empty()) return;
+    if (cmd.words[0] == "source") {
+        if (cmd.words.size() < 2) std::cout << "usage: source FILE\n";
+        else run_script(cmd.words[1], depth + 1);
+        return;
+    }
+    cmd.source = source;
+    cmd.line = line;
+    push(std::move(cmd));
+}
+
+void console_t::run_script(const std::string& filename, unsigned int depth) {
+    if (depth > MAX_SCRIPT_DEPTH) {
+        std::cout << "Script " << filename << " nested too deeply, skipped\n";
+        return;
+    }
+    std::ifstream in(filename);
+    if (!in) {
+        std::cout << "Cannot open script " << filename << "\n";
+        return;
+    }
+    std::string text;
+    unsigned int line = 0;
+    while (!stopping && std::getline(in, text)) handle_line(text, filename, ++line, depth);
+    if (wake) wake();
+}
+
+void console_t::read_loop(std::vector<std::string> scripts) {
+    for (const auto& s : scripts) run_script(s, 1);
+
+    // poll() with a timeout instead of a blocking read, so stop() can join
+    std::string pending;
+    unsigned int line = 0;
+    char buf[4096];
+    while (!stopping) {
+        struct pollfd p;
+        p.fd = STDIN_FILENO;
+        p.events = POLLIN;
+        p.revents = 0;
+        int r = ::poll(&p, 1, STDIN_POLL_MS);
+        if (r <= 0) continue;
+        ssize_t got = ::read(STDIN_FILENO, buf, sizeof(buf));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;    // EOF or closed stdin: nothing more to read
+
+        pending.append(buf, (size_t)got);
+        size_t start = 0, end;
+        bool queued = false;
+        while ((end = pending.find('\n', start)) != std::string::npos) {
+            handle_line(pending.substr(start, end - start), "stdin", ++line, 0);
+            start = end + 1;
+            queued = true;
+        }
+        pending.erase(0, start);
+        if (queued && wake) wake();
+    }
+    if (!stopping && !pending.empty()) {   // last line without a newline
+        handle_line(pending, "stdin", ++line, 0);
+        if (wake) wake();
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef CONSOLE_HPP
+#define CONSOLE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bounded single-producer/single-consumer ring. push() and pop() never
+// lock; each side only writes its own index.
+template <typename T, size_t N>
+class spsc_queue {
+public:
+    spsc_queue() : head(0), tail(0), slots(N) {}
+
+    bool push(T&& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) return false;  // full
+        slots[t % N] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;     // empty
+        item = std::move(slots[h % N]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::atomic<size_t> head;   // next slot to pop, written by the consumer
+    std::atomic<size_t> tail;   // next slot to push, written by the producer
+    std::vector<T> slots;
+};
+
+// One console line split into words; quotes group words with spaces.
+struct console_command {
+    std::vector<std::string> words;
+    std::string source;         // "stdin" or the script file name
+    unsigned int line;
+};
+
+// Reads commands from stdin on a background thread and hands them to the
+// render loop through a lock-free queue, so typing never blocks a frame.
+// Script files are read by the same thread (start() and "source FILE"),
+// which keeps the queue single-producer.
+class console_t {
+public:
+    console_t();
+    ~console_t();
+
+    // wake runs on the reader thread after it queues commands
+    void start(const std::vector<std::string>& scripts, std::function<void()> wake);
+    void stop();
+
+    // render loop: next queued command, false when none is waiting
+    bool poll(console_command& out) { return queue.pop(out); }
+
+private:
+    static const size_t QUEUE_SIZE = 256;
+    spsc_queue<console_command, QUEUE_SIZE> queue;
+    std::thread reader;
+    std::atomic<bool> stopping;
+    std::function<void()> wake;
+
+    void read_loop(std::vector<std::string> scripts);
+    void run_script(const std::string& filename, unsigned int depth);
+    void handle_line(const std::string& text, const std::string& source, unsigned int line,
+                     unsigned int depth);
+    void push(console_command&& cmd);
+
+    console_t(const console_t&);
+    console_t& operator=(const console_t&);
+};
+
+#endif // CONSOLE_HPP
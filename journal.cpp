@@ -0,0 +1,434 @@
+#include "journal.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <utility>
+
+static const unsigned int JOURNAL_VERSION = 1;
+// below this a journal isn't worth compacting, whatever the snapshot size
+static const size_t COMPACT_MIN_BYTES = 64 * 1024;
+
+static std::string journal_path(const std::string& filename) {
+    return filename + ".journal";
+}
+
+static size_t file_size(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    return in ? (size_t)in.tellg() : 0;
+}
+
+// ---------------- node_transform ----------------
+node_transform node_transform::of(const model_node* n) {
+    node_transform t;
+    t.translation = n->translation;
+    t.rotation = n->rotation;
+    t.scale = n->scale;
+    t.pivot = n->pivot;
+    return t;
+}
+
+void node_transform::apply(model_node* n) const {
+    n->translation = translation;
+    n->rotation = rotation;
+    n->scale = scale;
+    n->pivot = pivot;
+    n->mark_dirty();
+}
+
+bool node_transform::operator==(const node_transform& o) const {
+    return translation == o.translation && rotation == o.rotation && scale == o.scale && pivot == o.pivot;
+}
+
+static journal_node capture(const model_node* n) {
+    journal_node j;
+    j.id = n->id;
+    j.parent = n->parent ? n->parent->id : NO_NODE_ID;
+    j.before = n->next_sibling ? n->next_sibling->id : NO_NODE_ID;
+    j.type = n->shape ? (int32_t)n->shape->shapetype : -1;
+    j.level = n->shape ? n->shape->level : 0;
+    j.transform = node_transform::of(n);
+    j.color = n->color;
+    return j;
+}
+
+static edit_op inverse(const edit_op& op) {
+    edit_op inv = op;
+    if (op.kind == EDIT_ADD) inv.kind = EDIT_REMOVE;
+    else if (op.kind == EDIT_REMOVE) inv.kind = EDIT_ADD;
+    else std::swap(inv.before, inv.after);
+    return inv;
+}
+
+// ---------------- records ----------------
+// %.9g round-trips floats exactly, as in the .mod text format
+static void append_transform(std::string& out, const node_transform& t) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), " %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g",
+             t.translation.x, t.translation.y, t.translation.z,
+             t.rotation.x, t.rotation.y, t.rotation.z, t.rotation.w,
+             t.scale.x, t.scale.y, t.scale.z, t.pivot.x, t.pivot.y, t.pivot.z);
+    out += buf;
+}
+
+static void append_color(std::string& out, const glm::vec4& c) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), " %.9g %.9g %.9g %.9g", c.r, c.g, c.b, c.a);
+    out += buf;
+}
+
+// One record per line; a subtree add is one line per node, in preorder
+static size_t format_record(const edit_op& op, std::string& out) {
+    char buf[96];
+    switch (op.kind) {
+    case EDIT_ADD:
+        for (const auto& j : op.nodes) {
+            snprintf(buf, sizeof(buf), "add %u %u %u %d %u", j.id, j.parent, j.before, j.type, j.level);
+            out += buf;
+            append_transform(out, j.transform);
+            append_color(out, j.color);
+            out += '\n';
+        }
+        return op.nodes.size();
+    case EDIT_REMOVE:
+        if (op.nodes.empty()) return 0;
+        snprintf(buf, sizeof(buf), "remove %u\n", op.nodes[0].id);
+        out += buf;
+        return 1;
+    case EDIT_TRANSFORM:
+        snprintf(buf, sizeof(buf), "xform %u", op.after.id);
+        out += buf;
+        append_transform(out, op.after.transform);
+        out += '\n';
+        return 1;
+    case EDIT_COLOR:
+        snprintf(buf, sizeof(buf), "color %u", op.after.id);
+        out += buf;
+        append_color(out, op.after.color);
+        out += '\n';
+        return 1;
+    }
+    return 0;
+}
+
+static bool parse_transform(const char* p, node_transform& t, int& used) {
+    glm::vec3& tr = t.translation;
+    glm::quat& r = t.rotation;
+    glm::vec3& s = t.scale;
+    glm::vec3& pv = t.pivot;
+    return sscanf(p, "%f %f %f %f %f %f %f %f %f %f %f %f %f%n",
+                  &tr.x, &tr.y, &tr.z, &r.x, &r.y, &r.z, &r.w, &s.x, &s.y, &s.z, &pv.x, &pv.y, &pv.z, &used) == 13;
+}
+
+static bool parse_color(const char* p, glm::vec4& c) {
+    return sscanf(p, "%f %f %f %f", &c.r, &c.g, &c.b, &c.a) == 4;
+}
+
+static bool parse_record(const std::string& line, edit_op& op) {
+    char word[16];
+    int used = 0, more = 0;
+    const char* p = line.c_str();
+    if (sscanf(p, "%15s%n", word, &used) != 1) return false;
+    p += used;
+
+    op.nodes.clear();
+    if (!strcmp(word, "add")) {
+        journal_node j;
+        if (sscanf(p, "%u %u %u %d %u%n", &j.id, &j.parent, &j.before, &j.type, &j.level, &used) != 5) return false;
+        p += used;
+        if (!parse_transform(p, j.transform, more) || !parse_color(p + more, j.color)) return false;
+        op.kind = EDIT_ADD;
+        op.nodes.push_back(j);
+        return true;
+    }
+    if (!strcmp(word, "remove")) {
+        journal_node j;
+        if (sscanf(p, "%u", &j.id) != 1) return false;
+        op.kind = EDIT_REMOVE;
+        op.nodes.push_back(j);
+        return true;
+    }
+    if (!strcmp(word, "xform")) {
+        if (sscanf(p, "%u%n", &op.after.id, &used) != 1) return false;
+        op.kind = EDIT_TRANSFORM;
+        return parse_transform(p + used, op.after.transform, more);
+    }
+    if (!strcmp(word, "color")) {
+        if (sscanf(p, "%u%n", &op.after.id, &used) != 1) return false;
+        op.kind = EDIT_COLOR;
+        return parse_color(p + used, op.after.color);
+    }
+    return false;
+}
+
+// ---------------- edit_journal_t ----------------
+edit_journal_t::edit_journal_t()
+    : model(nullptr), pending_count(0), journal_bytes(0), snapshot_bytes(0), snapshot_nodes(0),
+      journal_valid(true) {}
+
+size_t edit_journal_t::attach(model_t* m, const std::string& filename) {
+    detach();
+    model = m;
+    if (!model || filename.empty()) return 0;
+
+    file = filename;
+    snapshot_bytes = file_size(filename);
+    snapshot_nodes = model->all_nodes.size();
+    return replay(journal_path(filename));
+}
+
+void edit_journal_t::detach() {
+    model = nullptr;
+    file.clear();
+    undo_stack.clear();
+    redo_stack.clear();
+    pending.clear();
+    pending_count = 0;
+    journal_bytes = snapshot_bytes = snapshot_nodes = 0;
+    journal_valid = true;
+}
+
+void edit_journal_t::record_add(model_node* n) {
+    if (!model || !n) return;
+    edit_op op;
+    op.kind = EDIT_ADD;
+    op.nodes.push_back(capture(n));
+    write_record(op);
+    push_undo(std::move(op));
+}
+
+void edit_journal_t::record_remove(model_node* n) {
+    if (!model || !n || n == model->root) return;
+    std::vector<model_node*> subtree;
+    n->collect(subtree);
+    edit_op op;
+    op.kind = EDIT_REMOVE;
+    op.nodes.reserve(subtree.size());
+    for (auto s : subtree) op.nodes.push_back(capture(s));
+    write_record(op);
+    push_undo(std::move(op));
+}
+
+void edit_journal_t::record_transform(model_node* n, const node_transform& before) {
+    if (!model || !n || node_transform::of(n) == before) return;
+    edit_op op;
+    op.kind = EDIT_TRANSFORM;
+    op.after = capture(n);
+    op.before = op.after;
+    op.before.transform = before;
+    write_record(op);
+    push_undo(std::move(op));
+}
+
+void edit_journal_t::record_color(model_node* n, const glm::vec4& before) {
+    if (!model || !n) return;
+    edit_op op;
+    op.kind = EDIT_COLOR;
+    op.after = capture(n);
+    op.before = op.after;
+    op.before.color = before;
+    write_record(op);
+    push_undo(std::move(op));
+}
+
+void edit_journal_t::push_undo(edit_op&& op) {
+    undo_stack.push_back(std::move(op));
+    if (undo_stack.size() > MAX_UNDO) undo_stack.pop_front();
+    redo_stack.clear();
+}
+
+// Undo applies the inverse and redo the edit itself; either way the
+// change is journaled like any other, so the journal stays append-only
+model_node* edit_journal_t::undo() {
+    if (!model || undo_stack.empty()) return nullptr;
+    edit_op op = std::move(undo_stack.back());
+    undo_stack.pop_back();
+    edit_op inv = inverse(op);
+    model_node* touched = nullptr;
+    if (!apply(inv, touched)) {
+        // the model was changed behind the history's back
+        std::cout << "Undo failed, history cleared\n";
+        undo_stack.clear();
+        redo_stack.clear();
+        return nullptr;
+    }
+    write_record(inv);
+    redo_stack.push_back(std::move(op));
+    return touched;
+}
+
+model_node* edit_journal_t::redo() {
+    if (!model || redo_stack.empty()) return nullptr;
+    edit_op op = std::move(redo_stack.back());
+    redo_stack.pop_back();
+    model_node* touched = nullptr;
+    if (!apply(op, touched)) {
+        std::cout << "Redo failed, history cleared\n";
+        undo_stack.clear();
+        redo_stack.clear();
+        return nullptr;
+    }
+    write_record(op);
+    undo_stack.push_back(std::move(op));
+    return touched;
+}
+
+bool edit_journal_t::apply(const edit_op& op, model_node*& touched) {
+    touched = nullptr;
+    switch (op.kind) {
+    case EDIT_ADD: {
+        // all or nothing: a half-restored subtree would never be journaled
+        std::vector<model_node*> restored;
+        restored.reserve(op.nodes.size());
+        for (const auto& j : op.nodes) {
+            model_node* parent = model->find(j.parent);
+            model_node* before = j.before != NO_NODE_ID ? model->find(j.before) : nullptr;
+            const shape_t* shape = nullptr;
+            if (j.type >= 0 && j.type < NUM_SHAPE_TYPES) shape = model->get_shape((ShapeType)j.type, j.level);
+            model_node* n = model->restore_node(j.id, shape, parent, before);
+            if (!n) {
+                // nodes come parent first, so backwards each one is a leaf
+                for (size_t i = restored.size(); i-- > 0; ) model->remove_node(restored[i]);
+                return false;
+            }
+            j.transform.apply(n);
+            n->color = j.color;
+            restored.push_back(n);
+        }
+        touched = restored.empty() ? nullptr : restored[0];
+        return !restored.empty();
+    }
+    case EDIT_REMOVE: {
+        model_node* n = op.nodes.empty() ? nullptr : model->find(op.nodes[0].id);
+        if (!n || n == model->root) return false;
+        model->remove_node(n);
+        return true;
+    }
+    case EDIT_TRANSFORM:
+        touched = model->find(op.after.id);
+        if (touched) op.after.transform.apply(touched);
+        return touched != nullptr;
+    case EDIT_COLOR:
+        touched = model->find(op.after.id);
+        if (touched) touched->set_color(op.after.color);
+        return touched != nullptr;
+    }
+    return false;
+}
+
+void edit_journal_t::write_record(const edit_op& op) {
+    pending_count += format_record(op, pending);
+}
+
+size_t edit_journal_t::replay(const std::string& journal_file) {
+    std::ifstream in(journal_file, std::ios::binary);
+    if (!in) return 0;
+
+    std::string line;
+    unsigned int version = 0;
+    size_t nodes = 0;
+    if (!std::getline(in, line) || sscanf(line.c_str(), "modjournal %u %zu", &version, &nodes) != 2
+        || version != JOURNAL_VERSION || nodes != model->all_nodes.size()) {
+        std::cout << journal_file << " doesn't match " << file << ", ignored\n";
+        journal_valid = false;
+        return 0;
+    }
+
+    size_t applied = 0;
+    unsigned int line_no = 1;
+    edit_op op;
+    while (std::getline(in, line)) {
+        line_no++;
+        if (line.empty()) continue;
+        model_node* touched;
+        if (!parse_record(line, op) || !apply(op, touched)) {
+            // most likely a write cut short; keep what replayed cleanly
+            std::cout << journal_file << ":" << line_no << ": bad record, ignoring the rest\n";
+            journal_valid = false;
+            break;
+        }
+        applied++;
+    }
+    journal_bytes = file_size(journal_file);
+    return applied;
+}
+
+bool edit_journal_t::save(const std::string& filename) {
+    if (!model) return false;
+    if (filename != file || !journal_valid) return write_snapshot(filename);
+
+    // replaying a journal larger than the snapshot costs more than loading
+    // a fresh snapshot, so that is the point to compact
+    size_t limit = snapshot_bytes > COMPACT_MIN_BYTES ? snapshot_bytes : COMPACT_MIN_BYTES;
+    if (journal_bytes + pending.size() > limit) return write_snapshot(filename);
+    if (pending.empty() && journal_bytes > 0) return true;
+
+    std::string out_path = journal_path(file);
+    std::ofstream out;
+    if (journal_bytes == 0) {
+        out.open(out_path, std::ios::binary | std::ios::trunc);
+        char header[64];
+        int len = snprintf(header, sizeof(header), "modjournal %u %zu\n", JOURNAL_VERSION, snapshot_nodes);
+        out.write(header, len);
+        journal_bytes = len;
+    } else {
+        out.open(out_path, std::ios::binary | std::ios::app);
+    }
+    out.write(pending.data(), pending.size());
+    out.close();
+    if (!out) {
+        // a partial append would be replayed as far as it got; snapshot next time
+        journal_valid = false;
+        return false;
+    }
+    journal_bytes += pending.size();
+    pending.clear();
+    pending_count = 0;
+    return true;
+}
+
+// A full save. Ids are renumbered to match what a reload of the new
+// snapshot gives, and the history is remapped to the new ids.
+bool edit_journal_t::write_snapshot(const std::string& filename) {
+    if (!model->save_to_file(filename)) return false;
+
+    std::vector<uint32_t> remap;
+    model->renumber_ids(remap);
+    remap_ids(remap);
+
+    file = filename;
+    snapshot_bytes = file_size(filename);
+    snapshot_nodes = model->all_nodes.size();
+    pending.clear();
+    pending_count = 0;
+    journal_bytes = 0;
+    journal_valid = true;
+
+    // an older journal must never be replayed over the new snapshot
+    std::remove(journal_path(filename).c_str());
+    return true;
+}
+
+// Live nodes take their new ids; ids of removed nodes, which only the
+// history still knows, get fresh ones so they can't collide
+void edit_journal_t::remap_ids(std::vector<uint32_t>& old_to_new) {
+    auto map = [&](uint32_t& id) {
+        if (id == NO_NODE_ID) return;
+        if (id >= old_to_new.size()) old_to_new.resize(id + 1, NO_NODE_ID);
+        if (old_to_new[id] == NO_NODE_ID) old_to_new[id] = model->reserve_id();
+        id = old_to_new[id];
+    };
+    auto map_node = [&](journal_node& j) {
+        map(j.id);
+        map(j.parent);
+        map(j.before);
+    };
+    std::deque<edit_op>* stacks[2] = { &undo_stack, &redo_stack };
+    for (auto stack : stacks) {
+        for (auto& op : *stack) {
+            for (auto& j : op.nodes) map_node(j);
+            map_node(op.before);
+            map_node(op.after);
+        }
+    }
+}
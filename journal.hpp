@@ -0,0 +1,110 @@
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <deque>
+#include <string>
+#include <vector>
+#include "model.hpp"
+
+// A node's local transform, as the journal and the undo stack store it
+struct node_transform {
+    glm::vec3 translation;
+    glm::quat rotation;
+    glm::vec3 scale;
+    glm::vec3 pivot;
+
+    static node_transform of(const model_node* n);
+    void apply(model_node* n) const;    // also marks n dirty
+    bool operator==(const node_transform& o) const;
+};
+
+// Everything needed to rebuild one node. parent and before (the next
+// sibling, NO_NODE_ID when last) are node ids.
+struct journal_node {
+    uint32_t id, parent, before;
+    int32_t type;           // ShapeType, -1 without a shape
+    uint32_t level;
+    node_transform transform;
+    glm::vec4 color;
+
+    journal_node() : id(NO_NODE_ID), parent(NO_NODE_ID), before(NO_NODE_ID), type(-1), level(0), color(1.0f) {}
+};
+
+enum EditKind { EDIT_ADD, EDIT_REMOVE, EDIT_TRANSFORM, EDIT_COLOR };
+
+// One undoable edit. Adds and removes carry the whole subtree in preorder,
+// so either can be inverted into the other; transform and color edits keep
+// the node's state before and after.
+struct edit_op {
+    EditKind kind;
+    std::vector<journal_node> nodes;    // EDIT_ADD, EDIT_REMOVE
+    journal_node before, after;         // EDIT_TRANSFORM, EDIT_COLOR
+};
+
+// Undo/redo history of a model plus an append-only journal next to its
+// file (FILE.journal). Edits are recorded as they happen and go to the
+// journal on save(), so saving costs O(edits since the last save) instead
+// of rewriting the model. Loading replays the journal over the snapshot.
+// Once the journal grows past the snapshot's size, save() writes a new
+// snapshot and starts an empty journal.
+//
+// Journal lines, one record each (ids as in model_t::find()):
+//   add ID PARENT BEFORE TYPE LEVEL tx ty tz rx ry rz rw sx sy sz px py pz r g b a
+//   remove ID
+//   xform ID tx ty tz rx ry rz rw sx sy sz px py pz
+//   color ID r g b a
+// after a "modjournal VERSION NODES" header giving the snapshot's node count.
+class edit_journal_t {
+public:
+    static const size_t MAX_UNDO = 256;
+
+    edit_journal_t();
+
+    // Starts a fresh history for model. With a file name, that file's
+    // journal (if any) is replayed first. Returns the records replayed.
+    size_t attach(model_t* model, const std::string& filename = std::string());
+    void detach();
+
+    // Call after the edit, except record_remove(), which needs the subtree
+    // before it is removed. A transform that changed nothing isn't recorded.
+    void record_add(model_node* n);
+    void record_remove(model_node* n);
+    void record_transform(model_node* n, const node_transform& before);
+    void record_color(model_node* n, const glm::vec4& before);
+
+    // Return the node the change left to select, or null (nothing left to
+    // undo, or the edit removed nodes)
+    model_node* undo();
+    model_node* redo();
+    bool can_undo() const { return !undo_stack.empty(); }
+    bool can_redo() const { return !redo_stack.empty(); }
+
+    // Saving to the attached file appends the pending records; any other
+    // name writes a snapshot there and attaches to it
+    bool save(const std::string& filename);
+    const std::string& filename() const { return file; }
+    size_t pending_records() const { return pending_count; }
+
+private:
+    model_t* model;
+    std::string file;           // snapshot the journal belongs to, empty if unsaved
+    std::deque<edit_op> undo_stack, redo_stack;
+    std::string pending;        // records not yet written to the journal
+    size_t pending_count;
+    size_t journal_bytes;       // on disk, header included
+    size_t snapshot_bytes;
+    size_t snapshot_nodes;      // what the journal header records
+    bool journal_valid;         // false after a failed replay; the next save snapshots
+
+    void push_undo(edit_op&& op);
+    bool apply(const edit_op& op, model_node*& touched);
+    void write_record(const edit_op& op);
+    size_t replay(const std::string& journal_file);
+    bool write_snapshot(const std::string& filename);
+    void remap_ids(std::vector<uint32_t>& old_to_new);
+
+    edit_journal_t(const edit_journal_t&);
+    edit_journal_t& operator=(const edit_journal_t&);
+};
+
+#endif // JOURNAL_HPP
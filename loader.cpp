@@ -0,0 +1,73 @@
+#include "loader.hpp"
+
+// share of progress() given to reading and parsing; the rest is uploads
+static const float PARSE_PROGRESS = 0.9f;
+
+model_loader_t::model_loader_t()
+    : staging(nullptr), running(false), uploads_total(0), uploads_left(0),
+      parsed(false), succeeded(false), load_progress(0.0f) {}
+
+model_loader_t::~model_loader_t() {
+    // the GL context may already be gone here; shutdown() is the clean path
+    if (worker.joinable()) worker.join();
+}
+
+bool model_loader_t::start(const std::string& filename, std::function<void()> on_parsed) {
+    if (running) return false;
+    file = filename;
+    staging = new model_t();
+    running = true;
+    uploads_total = uploads_left = 0;
+    parsed = false;
+    succeeded = false;
+    load_progress = 0.0f;
+
+    model_t* m = staging;
+    worker = std::thread([this, m, filename, on_parsed]() {
+        load_options options;
+        options.upload_meshes = false;
+        options.progress = &load_progress;
+        succeeded = m->load_from_file(filename, options);
+        parsed = true;
+        if (on_parsed) on_parsed();
+    });
+    return true;
+}
+
+float model_loader_t::progress() const {
+    if (!running) return 0.0f;
+    float p = load_progress.load(std::memory_order_relaxed) * PARSE_PROGRESS;
+    if (uploads_total) p += (1.0f - PARSE_PROGRESS) * (uploads_total - uploads_left) / uploads_total;
+    return p;
+}
+
+LoadStatus model_loader_t::poll(double budget_ms, model_t*& out) {
+    if (!running) return LOAD_IDLE;
+    if (!parsed) return LOAD_PENDING;
+    if (worker.joinable()) worker.join();
+
+    if (!succeeded) {
+        delete staging;     // also drops any meshes it queued
+        staging = nullptr;
+        running = false;
+        return LOAD_FAILED;
+    }
+
+    // the queue is shared, so this may also finish uploads nobody else needs yet
+    shape_cache_t& cache = shape_cache_t::instance();
+    if (!uploads_total) uploads_total = cache.pending_uploads();
+    uploads_left = cache.upload_pending(budget_ms);
+    if (uploads_left) return LOAD_PENDING;
+
+    out = staging;
+    staging = nullptr;
+    running = false;
+    return LOAD_DONE;
+}
+
+void model_loader_t::shutdown() {
+    if (worker.joinable()) worker.join();
+    delete staging;
+    staging = nullptr;
+    running = false;
+}
@@ -0,0 +1,48 @@
+#ifndef LOADER_HPP
+#define LOADER_HPP
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include "model.hpp"
+
+enum LoadStatus { LOAD_IDLE, LOAD_PENDING, LOAD_DONE, LOAD_FAILED };
+
+// Loads a model file on a background thread. File reading, parsing and
+// tessellation happen on the worker; GL uploads are done by poll() on the
+// thread owning the context, a few meshes per call, so a large load never
+// stalls a frame. One load at a time.
+class model_loader_t {
+public:
+    model_loader_t();
+    ~model_loader_t();
+
+    // false if a load is already running. on_parsed runs on the worker once
+    // the file is read (e.g. to wake an event wait).
+    bool start(const std::string& filename, std::function<void()> on_parsed = std::function<void()>());
+    bool busy() const { return running; }
+    float progress() const;             // 0..1, uploads are the last step
+    const std::string& filename() const { return file; }
+
+    // GL thread, once per frame. Spends about budget_ms on uploads. On
+    // LOAD_DONE the caller takes ownership of out.
+    LoadStatus poll(double budget_ms, model_t*& out);
+
+    void shutdown();    // waits for the worker and drops its model
+
+private:
+    std::thread worker;
+    std::string file;
+    model_t* staging;                   // fresh model, only the worker touches it until parsed
+    bool running;
+    size_t uploads_total, uploads_left;  // set once poll() starts uploading
+    std::atomic<bool> parsed;
+    std::atomic<bool> succeeded;
+    std::atomic<float> load_progress;
+
+    model_loader_t(const model_loader_t&);
+    model_loader_t& operator=(const model_loader_t&);
+};
+
+#endif // LOADER_HPP
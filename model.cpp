@@ -1,204 +1,1133 @@
 #include "model.hpp"
+#include "thread_pool.hpp"
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cfloat>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
-model_node::model_node(shape_t* s, model_node* p)
+model_node::model_node(const shape_t* s, model_node* p)
     : shape(s), 
-      translation(glm::mat4(1.0f)),
-      rotation(glm::mat4(1.0f)),
-      scale(glm::mat4(1.0f)),
+      translation(0.0f),
+      rotation(1.0f, 0.0f, 0.0f, 0.0f),
+      scale(1.0f),
+      pivot(s ? s->centroid : glm::vec3(0.0f)),
       color(1.0f,1.0f,1.0f,1.0f),
-      parent(p)
+      parent(nullptr),
+      first_child(nullptr),
+      last_child(nullptr),
+      prev_sibling(nullptr),
+      next_sibling(nullptr),
+      child_count(0),
+      world(glm::mat4(1.0f)),
+      dirty(false),
+      subtree_dirty(false),
+      bounds_min(FLT_MAX), bounds_max(-FLT_MAX),
+      subtree_min(FLT_MAX), subtree_max(-FLT_MAX),
+      world_centroid(0.0f),
+      in_centroid_sum(false),
+      lod_level(s ? s->level : 0),
+      frozen(nullptr),
+      list_index(0),
+      slot(0),
+      id(NO_NODE_ID),
+      prev_created(nullptr),
+      next_created(nullptr)
 {
-    if (parent) parent->add_child(this);
+    if (p) p->add_child(this);
+    else mark_dirty();
 }
 
-model_node::~model_node() {
-    for (auto c : children) delete c;
-    children.clear();
+void model_node::add_child(model_node* c) {
+    c->parent = this;
+    c->prev_sibling = last_child;
+    c->next_sibling = nullptr;
+    if (last_child) last_child->next_sibling = c;
+    else first_child = c;
+    last_child = c;
+    child_count++;
+    c->mark_dirty();
 }
 
-void model_node::add_child(model_node* c) {
-    children.push_back(c);
+void model_node::insert_child(model_node* c, model_node* before) {
+    if (!before || before->parent != this) {
+        add_child(c);
+        return;
+    }
     c->parent = this;
+    c->prev_sibling = before->prev_sibling;
+    c->next_sibling = before;
+    if (before->prev_sibling) before->prev_sibling->next_sibling = c;
+    else first_child = c;
+    before->prev_sibling = c;
+    child_count++;
+    c->mark_dirty();
 }
 
 void model_node::remove_child(model_node* c) {
-    children.erase(std::remove(children.begin(), children.end(), c), children.end());
+    if (!c || c->parent != this) return;
+    if (c->prev_sibling) c->prev_sibling->next_sibling = c->next_sibling;
+    else first_child = c->next_sibling;
+    if (c->next_sibling) c->next_sibling->prev_sibling = c->prev_sibling;
+    else last_child = c->prev_sibling;
+    c->prev_sibling = c->next_sibling = nullptr;
+    c->parent = nullptr;
+    child_count--;
 }
 
+// T(translation + pivot) * R * S * T(-pivot), written out: the rotation
+// columns scaled by S, and the translation that keeps the pivot in place
 glm::mat4 model_node::local_matrix() const {
-    return translation * rotation * scale;
+    const glm::quat& q = rotation;
+    float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+    float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+    float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+    glm::vec3 c0 = glm::vec3(1.0f - 2.0f * (yy + zz), 2.0f * (xy + wz), 2.0f * (xz - wy)) * scale.x;
+    glm::vec3 c1 = glm::vec3(2.0f * (xy - wz), 1.0f - 2.0f * (xx + zz), 2.0f * (yz + wx)) * scale.y;
+    glm::vec3 c2 = glm::vec3(2.0f * (xz + wy), 2.0f * (yz - wx), 1.0f - 2.0f * (xx + yy)) * scale.z;
+    glm::vec3 t = translation + pivot - (c0 * pivot.x + c1 * pivot.y + c2 * pivot.z);
+    return glm::mat4(glm::vec4(c0, 0.0f), glm::vec4(c1, 0.0f), glm::vec4(c2, 0.0f), glm::vec4(t, 1.0f));
+}
+
+// Rotating the whole local transform about point turns the rotation and
+// swings the pivot's position around point
+void model_node::rotate_about(const glm::quat& q, const glm::vec3& point) {
+    glm::vec3 placed = translation + pivot;     // where the pivot lands in parent space
+    translation = point + q * (placed - point) - pivot;
+    rotation = glm::normalize(q * rotation);
+    mark_dirty();
+}
+
+void model_node::set_pivot(const glm::vec3& p) {
+    glm::vec3 rs_old = rotation * (scale * pivot);
+    glm::vec3 rs_new = rotation * (scale * p);
+    translation += (pivot - rs_old) - (p - rs_new);
+    pivot = p;
+    mark_dirty();
+}
+
+const glm::mat4& model_node::get_world_matrix() const {
+    return world;
+}
+
+void model_node::set_color(const glm::vec4& c) {
+    color = c;
+    if (frozen) frozen->stale = true;
+}
+
+// Flags this node for recomputation and tells its ancestors that a
+// descendant needs a refresh; stops at the first already-flagged ancestor.
+void model_node::mark_dirty() {
+    dirty = true;
+    // the merged mesh is in the frozen root's space, so only the root may move
+    if (frozen && frozen->root != this) frozen->stale = true;
+    mark_subtree_dirty();
 }
 
-glm::mat4 model_node::get_world_matrix() const {
-    if (parent) {
-        return parent->get_world_matrix() * local_matrix();
+void model_node::mark_subtree_dirty() {
+    for (model_node* n = this; n && !n->subtree_dirty; n = n->parent) {
+        n->subtree_dirty = true;
     }
-    return local_matrix();
+}
+
+void model_node::refresh_world(const glm::mat4* parent_world, centroid_sum& centroids) {
+    // composing from TRS is cheaper than keeping a cached local matrix
+    glm::mat4 local = local_matrix();
+    world = parent_world ? *parent_world * local : local;
+
+    // transform the shape's box: center by the matrix, extents by |M|
+    if (shape) {
+        glm::vec3 c = 0.5f * (shape->bounds_min + shape->bounds_max);
+        glm::vec3 e = 0.5f * (shape->bounds_max - shape->bounds_min);
+        glm::vec3 wc(world * glm::vec4(c, 1.0f));
+        glm::vec3 we = glm::abs(glm::vec3(world[0])) * e.x
+                     + glm::abs(glm::vec3(world[1])) * e.y
+                     + glm::abs(glm::vec3(world[2])) * e.z;
+        bounds_min = wc - we;
+        bounds_max = wc + we;
+
+        if (in_centroid_sum) centroids.remove(world_centroid);
+        world_centroid = glm::vec3(world * glm::vec4(shape->centroid, 1.0f));
+        centroids.add(world_centroid);
+        in_centroid_sum = true;
+    }
+}
+
+void model_node::update_world(const glm::mat4& parent_world, bool parent_changed, centroid_sum& centroids) {
+    bool changed = dirty || parent_changed;
+    dirty = false;
+    if (changed) refresh_world(parent ? &parent_world : nullptr, centroids);
+    if (changed || subtree_dirty) {
+        subtree_min = bounds_min;
+        subtree_max = bounds_max;
+        for (model_node* c = first_child; c; c = c->next_sibling) {
+            c->update_world(world, changed, centroids);
+            subtree_min = glm::min(subtree_min, c->subtree_min);
+            subtree_max = glm::max(subtree_max, c->subtree_max);
+        }
+    }
+    subtree_dirty = false;
 }
 
 void model_node::collect(std::vector<model_node*>& out) {
     out.push_back(this);
-    for (auto c : children) c->collect(out);
+    for (model_node* c = first_child; c; c = c->next_sibling) c->collect(out);
 }
 
 // ---------------- model_t ----------------
 
-model_t::model_t() {
-    root = new model_node(nullptr, nullptr);
-    all_nodes.push_back(root);
+model_t::model_t()
+    : parallel_update(true), newest(nullptr), next_id(0), structure_stamp_value(0), world_stamp_value(0) {
+    root = new_node(nullptr, nullptr);
 }
 
 model_t::~model_t() {
-    delete root;
-    for (auto s : owned_shapes) delete s;
-    owned_shapes.clear();
+    clear_nodes();
+    free_chunks();
+    release_shapes();
+}
+
+model_node* model_t::new_node(const shape_t* s, model_node* parent) {
+    uint32_t slot;
+    if (free_slots.empty()) {
+        slot = (uint32_t)slots.size();
+        if (slot / NODES_PER_CHUNK >= chunks.size()) {
+            chunks.push_back(static_cast<model_node*>(::operator new(NODES_PER_CHUNK * sizeof(model_node))));
+        }
+        slots.push_back(node_slot{nullptr, 0});
+    } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+
+    model_node* n = new (chunks[slot / NODES_PER_CHUNK] + slot % NODES_PER_CHUNK) model_node(s, parent);
+    n->slot = slot;
+    slots[slot].node = n;
+    n->id = next_id++;
+    by_id.push_back(n);
+
+    n->list_index = (uint32_t)all_nodes.size();
+    all_nodes.push_back(n);
+
+    n->prev_created = newest;
+    n->next_created = nullptr;
+    if (newest) newest->next_created = n;
+    newest = n;
+    flat.valid = false;
+    structure_stamp_value = 0;
+    return n;
+}
+
+// Unlinks n from the bookkeeping and returns its slot to the pool; the
+// caller has already detached it from the tree.
+void model_t::free_node(model_node* n) {
+    if (n->in_centroid_sum) centroids.remove(n->world_centroid);
+    if (n->frozen) {
+        n->frozen->stale = true;
+        if (n->frozen->root == n) n->frozen->root = nullptr;
+    }
+    flat.valid = false;
+    structure_stamp_value = 0;
+
+    model_node* last = all_nodes.back();
+    all_nodes[n->list_index] = last;
+    last->list_index = n->list_index;
+    all_nodes.pop_back();
+
+    if (n->prev_created) n->prev_created->next_created = n->next_created;
+    if (n->next_created) n->next_created->prev_created = n->prev_created;
+    if (newest == n) newest = n->prev_created;
+    by_id[n->id] = nullptr;
+
+    uint32_t slot = n->slot;
+    n->~model_node();
+    slots[slot].node = nullptr;
+    slots[slot].generation++;
+    free_slots.push_back(slot);
+}
+
+// Destroys every node in one sweep over the pool. Chunks are kept and
+// generations bumped, so old handles stay invalid after a reload.
+void model_t::clear_nodes() {
+    for (auto f : frozen) destroy_frozen(f);
+    frozen.clear();
+    for (auto n : all_nodes) n->~model_node();
     all_nodes.clear();
+    free_slots.clear();
+    for (size_t i = slots.size(); i-- > 0; ) {
+        if (slots[i].node) {
+            slots[i].node = nullptr;
+            slots[i].generation++;
+        }
+        free_slots.push_back((uint32_t)i);
+    }
+    root = nullptr;
+    newest = nullptr;
+    by_id.clear();
+    next_id = 0;
+    flat.valid = false;
+    structure_stamp_value = 0;
+    centroids = centroid_sum();
+}
+
+void model_t::free_chunks() {
+    for (auto c : chunks) ::operator delete(c);
+    chunks.clear();
+}
+
+model_node* model_t::find(uint32_t id) const {
+    return id < by_id.size() ? by_id[id] : nullptr;
+}
+
+model_node* model_t::restore_node(uint32_t id, const shape_t* shape, model_node* parent, model_node* before) {
+    if (!parent || find(id)) return nullptr;
+    model_node* n = new_node(shape, nullptr);
+    // new_node took the next id; hand it back and use the old one
+    by_id.pop_back();
+    next_id--;
+    if (id >= by_id.size()) {
+        by_id.resize(id + 1, nullptr);
+        next_id = id + 1;
+    }
+    n->id = id;
+    by_id[id] = n;
+    parent->insert_child(n, before);
+    return n;
+}
+
+void model_t::renumber_ids(std::vector<uint32_t>& remap) {
+    remap.assign(next_id, NO_NODE_ID);
+    std::vector<model_node*> nodes;
+    if (root) root->collect(nodes);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        remap[nodes[i]->id] = (uint32_t)i;
+        nodes[i]->id = (uint32_t)i;
+    }
+    by_id.swap(nodes);
+    next_id = (uint32_t)by_id.size();
+}
+
+node_handle model_t::handle_of(const model_node* node) const {
+    if (!node || node->slot >= slots.size() || slots[node->slot].node != node) return node_handle();
+    return node_handle(node->slot, slots[node->slot].generation);
+}
+
+model_node* model_t::get(node_handle h) const {
+    if (h.index >= slots.size() || slots[h.index].generation != h.generation) return nullptr;
+    return slots[h.index].node;
+}
+
+model_node* model_t::previous_created(const model_node* node) const {
+    if (!node || node->prev_created == root) return nullptr;
+    return node->prev_created;
+}
+
+const shape_t* model_t::get_shape(ShapeType type, unsigned int level) {
+    level = shape_cache_t::normalize_level(type, level);
+    for (auto s : owned_shapes) {
+        if (s->shapetype == type && s->level == level) return s;
+    }
+    const shape_t* s = shape_cache_t::instance().acquire(type, level);
+    if (s) owned_shapes.push_back(s);
+    return s;
+}
+
+void model_t::release_shapes() {
+    for (auto s : owned_shapes) shape_cache_t::instance().release(s);
+    owned_shapes.clear();
 }
 
 model_node* model_t::create_sphere(unsigned int level, model_node* parent) {
     if (!parent) parent = root;
-    shape_t* s = new sphere_t(level);
-    owned_shapes.push_back(s);
-    auto node = new model_node(s, parent);
-    all_nodes.push_back(node);
-    return node;
+    const shape_t* s = get_shape(SPHERE_SHAPE, level);
+    return new_node(s, parent);
 }
 
 model_node* model_t::create_cylinder(unsigned int level, model_node* parent) {
     if (!parent) parent = root;
-    shape_t* s = new cylinder_t(level);
-    owned_shapes.push_back(s);
-    auto node = new model_node(s, parent);
-    all_nodes.push_back(node);
-    return node;
+    const shape_t* s = get_shape(CYLINDER_SHAPE, level);
+    return new_node(s, parent);
 }
 
 model_node* model_t::create_box(model_node* parent) {
     if (!parent) parent = root;
-    shape_t* s = new box_t();
-    owned_shapes.push_back(s);
-    auto node = new model_node(s, parent);
-    all_nodes.push_back(node);
-    return node;
+    const shape_t* s = get_shape(BOX_SHAPE, 0);
+    return new_node(s, parent);
 }
 
 model_node* model_t::create_cone(unsigned int level, model_node* parent) {
     if (!parent) parent = root;
-    shape_t* s = new cone_t(level);
-    owned_shapes.push_back(s);
-    auto node = new model_node(s, parent);
-    all_nodes.push_back(node);
-    return node;
+    const shape_t* s = get_shape(CONE_SHAPE, level);
+    return new_node(s, parent);
+}
+
+// below this the recursive pass, which skips clean subtrees, is faster
+static const size_t PARALLEL_UPDATE_NODES = 8192;
+static const size_t UPDATE_GRAIN = 1024;      // nodes per pool task
+
+static uint64_t new_stamp() {
+    static std::atomic<uint64_t> next(1);
+    return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t model_t::structure_stamp() {
+    if (!structure_stamp_value) structure_stamp_value = new_stamp();
+    return structure_stamp_value;
+}
+
+uint64_t model_t::world_stamp() {
+    if (!world_stamp_value) world_stamp_value = new_stamp();
+    return world_stamp_value;
+}
+
+void model_t::update_world_matrices() {
+    if (!root || !root->subtree_dirty) return;
+    world_stamp_value = 0;
+    if (parallel_update && all_nodes.size() >= PARALLEL_UPDATE_NODES && thread_pool_t::instance().size() > 0)
+        update_world_levels();
+    else
+        root->update_world(glm::mat4(1.0f), false, centroids);
+}
+
+const std::vector<model_node*>& model_t::flat_nodes() {
+    if (!flat.valid) build_flat();
+    return flat.nodes;
+}
+
+void model_t::build_flat() {
+    flat.nodes.clear();
+    flat.parent.clear();
+    flat.child_begin.clear();
+    flat.level_start.clear();
+    flat.nodes.reserve(all_nodes.size());
+    flat.parent.reserve(all_nodes.size());
+    flat.child_begin.reserve(all_nodes.size());
+
+    if (root) {
+        flat.nodes.push_back(root);
+        flat.parent.push_back(-1);
+    }
+    flat.level_start.push_back(0);
+    size_t begin = 0;
+    while (begin < flat.nodes.size()) {
+        size_t end = flat.nodes.size();
+        for (size_t i = begin; i < end; i++) {
+            flat.child_begin.push_back((uint32_t)flat.nodes.size());
+            for (model_node* c = flat.nodes[i]->first_child; c; c = c->next_sibling) {
+                flat.nodes.push_back(c);
+                flat.parent.push_back((int32_t)i);
+            }
+        }
+        flat.level_start.push_back((uint32_t)end);
+        begin = end;
+    }
+    flat.changed.assign(flat.nodes.size(), 0);
+    flat.valid = true;
+}
+
+// Same result as the recursive pass, one tree level at a time: nodes of a
+// level only read their parent's world matrix, which the previous level
+// finished, so each level splits freely across the pool. Subtree bounds
+// then go bottom-up, each node pulling from its (contiguous) children.
+void model_t::update_world_levels() {
+    if (!flat.valid) build_flat();
+    thread_pool_t& pool = thread_pool_t::instance();
+    std::mutex centroid_mutex;
+    size_t levels = flat.level_start.size() - 1;
+
+    for (size_t l = 0; l < levels; l++) {
+        pool.parallel_for(flat.level_start[l], flat.level_start[l + 1], UPDATE_GRAIN, [&](size_t b, size_t e) {
+            centroid_sum delta;
+            for (size_t i = b; i < e; i++) {
+                model_node* n = flat.nodes[i];
+                int32_t p = flat.parent[i];
+                bool changed = n->dirty || (p >= 0 && flat.changed[p]);
+                flat.changed[i] = changed;
+                n->dirty = false;
+                if (changed) n->refresh_world(p >= 0 ? &flat.nodes[p]->world : nullptr, delta);
+            }
+            std::lock_guard<std::mutex> lock(centroid_mutex);
+            centroids.merge(delta);
+        });
+    }
+
+    for (size_t l = levels; l-- > 0; ) {
+        pool.parallel_for(flat.level_start[l], flat.level_start[l + 1], UPDATE_GRAIN, [&](size_t b, size_t e) {
+            for (size_t i = b; i < e; i++) {
+                model_node* n = flat.nodes[i];
+                if (flat.changed[i] || n->subtree_dirty) {
+                    n->subtree_min = n->bounds_min;
+                    n->subtree_max = n->bounds_max;
+                    for (size_t c = flat.child_begin[i], end = c + n->child_count; c < end; c++) {
+                        n->subtree_min = glm::min(n->subtree_min, flat.nodes[c]->subtree_min);
+                        n->subtree_max = glm::max(n->subtree_max, flat.nodes[c]->subtree_max);
+                    }
+                }
+                n->subtree_dirty = false;
+            }
+        });
+    }
+}
+
+glm::vec3 model_t::centroid() {
+    update_world_matrices();
+    if (!centroids.count) {
+        centroids = centroid_sum();  // drop any rounding left by removals
+        return glm::vec3(0.0f);
+    }
+    double inv = 1.0 / centroids.count;
+    return glm::vec3((float)(centroids.x * inv), (float)(centroids.y * inv), (float)(centroids.z * inv));
+}
+
+bool model_t::bounds(glm::vec3& min, glm::vec3& max) {
+    update_world_matrices();
+    if (!root || root->subtree_min.x > root->subtree_max.x) return false;
+    min = root->subtree_min;
+    max = root->subtree_max;
+    return true;
 }
 
 void model_t::remove_node(model_node* node) {
     if (!node || node == root) return;
 
     if (node->parent) {
+        node->parent->mark_subtree_dirty();  // ancestors' bounds shrink
         node->parent->remove_child(node);
     }
 
-    // Remove from all_nodes list
-    all_nodes.erase(std::remove(all_nodes.begin(), all_nodes.end(), node), all_nodes.end());
-    
-    // Remove children from all_nodes as well
+    // return the whole subtree to the pool
     std::vector<model_node*> to_remove;
     node->collect(to_remove);
-    for (auto n : to_remove) {
-        if (n != node) {
-            all_nodes.erase(std::remove(all_nodes.begin(), all_nodes.end(), n), all_nodes.end());
+    for (auto n : to_remove) free_node(n);
+}
+
+// Walks the subtree with each node's matrix relative to the frozen root,
+// appending its triangles and tagging it as part of f. With lod_model set,
+// nodes are baked at their lod_level instead of their base mesh.
+static void bake_subtree(model_node* n, const glm::mat4& rel, frozen_subtree* f, model_t* lod_model,
+                         std::vector<baked_vertex>& vertices, std::vector<GLuint>& indices,
+                         std::vector<glm::vec3>& positions, std::vector<GLuint>& shape_indices) {
+    n->frozen = f;
+    const shape_t* shape = n->shape;
+    if (shape && lod_model && n->lod_level != shape->level) {
+        const shape_t* s = lod_model->get_shape(shape->shapetype, n->lod_level);
+        if (s) shape = s;
+    }
+    if (shape && shape->read_back(positions, shape_indices) && !shape_indices.empty()) {
+        baked_vertex v;
+        for (int i = 0; i < 4; i++) {
+            float c = n->color[i] < 0.0f ? 0.0f : (n->color[i] > 1.0f ? 1.0f : n->color[i]);
+            v.color[i] = (uint8_t)(c * 255.0f + 0.5f);
+        }
+        GLuint base = (GLuint)vertices.size();
+        for (const auto& p : positions) {
+            v.position = glm::vec3(rel * glm::vec4(p, 1.0f));
+            vertices.push_back(v);
+        }
+        for (GLuint i : shape_indices) indices.push_back(base + i);
+        f->node_count++;
+    }
+    for (model_node* c = n->first_child; c; c = c->next_sibling)
+        bake_subtree(c, rel * c->local_matrix(), f, lod_model, vertices, indices, positions, shape_indices);
+}
+
+static void clear_frozen(model_node* n, frozen_subtree* f) {
+    if (n->frozen != f) return;     // added after freezing, or frozen again since
+    n->frozen = nullptr;
+    for (model_node* c = n->first_child; c; c = c->next_sibling) clear_frozen(c, f);
+}
+
+bool model_t::freeze(model_node* node, bool at_lod_level) {
+    sync_frozen();
+    if (!node || node->frozen) return false;
+
+    // a frozen subtree inside this one is absorbed into the new mesh
+    for (size_t i = frozen.size(); i-- > 0; ) {
+        model_node* r = frozen[i]->root;
+        for (model_node* a = r ? r->parent : nullptr; a; a = a->parent) {
+            if (a == node) { unfreeze(r); break; }
         }
     }
 
-    delete node;
+    frozen_subtree* f = new frozen_subtree();
+    f->root = node;
+    f->stale = false;
+    f->vao = f->vbo = f->ebo = 0;
+    f->node_count = 0;
+
+    std::vector<baked_vertex> vertices;
+    std::vector<GLuint> indices;
+    std::vector<glm::vec3> positions;
+    std::vector<GLuint> shape_indices;
+    bake_subtree(node, glm::mat4(1.0f), f, at_lod_level ? this : nullptr, vertices, indices, positions, shape_indices);
+    f->index_count = (GLsizei)indices.size();
+    f->vertex_count = vertices.size();
+    if (indices.empty()) {
+        clear_frozen(node, f);
+        delete f;
+        return false;
+    }
+
+    glGenVertexArrays(1, &f->vao);
+    glGenBuffers(1, &f->vbo);
+    glGenBuffers(1, &f->ebo);
+    glBindVertexArray(f->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, f->vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(baked_vertex), vertices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, f->ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(baked_vertex), (void*)offsetof(baked_vertex, position));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(5, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(baked_vertex), (void*)offsetof(baked_vertex, color));
+    glEnableVertexAttribArray(5);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    frozen.push_back(f);
+    return true;
+}
+
+void model_t::unfreeze(model_node* node) {
+    if (!node || !node->frozen || node->frozen->root != node) return;
+    frozen_subtree* f = node->frozen;
+    clear_frozen(node, f);
+    frozen.erase(std::find(frozen.begin(), frozen.end(), f));
+    destroy_frozen(f);
+}
+
+void model_t::sync_frozen() {
+    for (size_t i = frozen.size(); i-- > 0; ) {
+        frozen_subtree* f = frozen[i];
+        if (!f->stale) continue;
+        if (f->root) clear_frozen(f->root, f);
+        frozen.erase(frozen.begin() + i);
+        destroy_frozen(f);
+    }
+}
+
+// GL objects only; the nodes are the caller's to untag
+void model_t::destroy_frozen(frozen_subtree* f) {
+    if (f->vao) glDeleteVertexArrays(1, &f->vao);
+    if (f->vbo) glDeleteBuffers(1, &f->vbo);
+    if (f->ebo) glDeleteBuffers(1, &f->ebo);
+    delete f;
 }
 
-bool model_t::save_to_file(const std::string& filename) const {
-    std::ofstream out(filename);
+static bool ends_with(const std::string& str, const std::string& suffix) {
+    return str.size() >= suffix.size() &&
+           str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Both file formats describe a node with the same fields; the binary
+// format stores this record as is.
+struct mod_binary_node {
+    int32_t type;           // ShapeType, -1 for no shape
+    int32_t parent;         // node index, -1 for the root
+    uint32_t level;         // tessellation level
+    float translation[3];
+    float rotation[4];      // quaternion x y z w
+    float scale[3];
+    float color[4];
+    float pivot[3];         // version 2 and later
+};
+
+static_assert(sizeof(mod_binary_node) == 80, "unexpected .modb node size");
+static const size_t MODB_V1_NODE_SIZE = 68;     // the same record without pivot
+
+// Preorder list of the tree (same order as collect()) together with each
+// node's parent position, -1 for the root. One pass, no index lookups.
+static void flatten(model_node* root, std::vector<model_node*>& nodes, std::vector<int32_t>& parents) {
+    nodes.clear();
+    parents.clear();
+    std::vector<std::pair<model_node*, int32_t> > stack;
+    stack.push_back(std::make_pair(root, -1));
+    while (!stack.empty()) {
+        std::pair<model_node*, int32_t> top = stack.back();
+        stack.pop_back();
+        int32_t idx = (int32_t)nodes.size();
+        nodes.push_back(top.first);
+        parents.push_back(top.second);
+        for (model_node* c = top.first->last_child; c; c = c->prev_sibling)
+            stack.push_back(std::make_pair(c, idx));
+    }
+}
+
+static void fill_record(const model_node* n, int32_t parent, mod_binary_node& rec) {
+    rec.type = n->shape ? (int32_t)n->shape->shapetype : -1;
+    rec.level = n->shape ? n->shape->level : 0;
+    rec.parent = parent;
+
+    // the node's own fields, so a reload is bit-exact
+    for (int k = 0; k < 3; k++) {
+        rec.translation[k] = n->translation[k];
+        rec.scale[k] = n->scale[k];
+        rec.pivot[k] = n->pivot[k];
+    }
+    rec.rotation[0] = n->rotation.x; rec.rotation[1] = n->rotation.y;
+    rec.rotation[2] = n->rotation.z; rec.rotation[3] = n->rotation.w;
+    for (int k = 0; k < 4; k++) rec.color[k] = n->color[k];
+}
+
+// Binary .modb layout (native endianness, all offsets from file start):
+//   mod_binary_header
+//   mod_binary_node[node_count]     preorder, parent index < own index
+//   mod_binary_mesh[mesh_count]     optional embedded meshes
+//   mesh blobs: float xyz per vertex, then uint32 indices
+namespace {
+
+const char MODB_MAGIC[4] = {'M', 'O', 'D', 'B'};
+const uint32_t MODB_VERSION = 2;     // 1: node records without pivot, still loaded
+
+struct mod_binary_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t mesh_count;
+    uint64_t node_offset;
+    uint64_t mesh_offset;
+};
+
+struct mod_binary_mesh {
+    int32_t type;
+    uint32_t level;
+    uint32_t vertex_count;
+    uint32_t index_count;
+    uint64_t vertex_offset;
+    uint64_t index_offset;
+};
+
+static_assert(sizeof(mod_binary_header) == 32, "unexpected .modb header size");
+static_assert(sizeof(mod_binary_mesh) == 32, "unexpected .modb mesh size");
+
+// Read-only mapping of a whole file
+struct mapped_file {
+    const unsigned char* data;
+    size_t size;
+
+    mapped_file() : data(nullptr), size(0) {}
+    ~mapped_file() { if (data) munmap((void*)data, size); }
+
+    bool open(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) { close(fd); return false; }
+        void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) return false;
+        data = (const unsigned char*)p;
+        size = (size_t)st.st_size;
+        return true;
+    }
+};
+
+// Number scanner over a NUL-terminated buffer that never crosses a line
+// end, so a short line fails instead of eating the next one.
+struct line_scanner {
+    const char* p;
+
+    // skips spaces/tabs; false at a line end (strtol/strtof would skip it)
+    bool skip_blanks() {
+        while (*p == ' ' || *p == '\t') ++p;
+        return *p && *p != '\n' && *p != '\r';
+    }
+
+    bool read_int(int& v) {
+        if (!skip_blanks()) return false;
+        char* end;
+        long x = strtol(p, &end, 10);
+        if (end == p) return false;
+        v = (int)x; p = end;
+        return true;
+    }
+
+    bool read_float(float& v) {
+        if (!skip_blanks()) return false;
+        char* end;
+        v = strtof(p, &end);
+        if (end == p) return false;
+        p = end;
+        return true;
+    }
+
+    void next_line() {
+        while (*p && *p != '\n') ++p;
+        if (*p == '\n') ++p;
+    }
+};
+
+} // namespace
+
+bool model_t::save_to_file(const std::string& filename, bool embed_meshes) const {
+    if (ends_with(filename, ".modb")) return save_binary(filename, embed_meshes);
+    return save_text(filename);
+}
+
+bool model_t::load_from_file(const std::string& filename, const load_options& options) {
+    if (ends_with(filename, ".modb")) return load_binary(filename, options);
+    return load_text(filename, options);
+}
+
+bool model_t::save_text(const std::string& filename) const {
+    std::ofstream out(filename, std::ios::binary);
     if (!out) return false;
 
-    // Format: type parent_index tx ty tz rx ry rz rw sx sy sz r g b
-    // Using quaternion for rotation (simplified)
+    // Format: type parent_index tx ty tz rx ry rz rw sx sy sz r g b level px py pz
     std::vector<model_node*> nodes;
-    root->collect(nodes);
+    std::vector<int32_t> parents;
+    flatten(root, nodes, parents);
 
+    // format everything into one buffer and write it in a single call;
+    // %.9g round-trips floats exactly
+    std::string buf;
+    buf.reserve(nodes.size() * 128);
+    char line[512];
     for (size_t i=0; i<nodes.size(); i++) {
-        model_node* n = nodes[i];
-        int parentIdx = -1;
-        if (n->parent) {
-            for (size_t j=0;j<nodes.size();j++) {
-                if (nodes[j] == n->parent) { parentIdx = (int)j; break; }
+        mod_binary_node rec;
+        fill_record(nodes[i], parents[i], rec);
+        int len = snprintf(line, sizeof(line),
+            "%d %d %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %u %.9g %.9g %.9g\n",
+            rec.type, rec.parent,
+            rec.translation[0], rec.translation[1], rec.translation[2],
+            rec.rotation[0], rec.rotation[1], rec.rotation[2], rec.rotation[3],
+            rec.scale[0], rec.scale[1], rec.scale[2],
+            rec.color[0], rec.color[1], rec.color[2], rec.level,
+            rec.pivot[0], rec.pivot[1], rec.pivot[2]);
+        if (len > 0) buf.append(line, std::min((size_t)len, sizeof(line) - 1));
+    }
+
+    out.write(buf.data(), buf.size());
+    return (bool)out;
+}
+
+// parsing is most of a text load; node building gets the remainder
+static const float TEXT_PARSE_PROGRESS = 0.7f;
+
+static void report_progress(const load_options& options, float p) {
+    if (options.progress) options.progress->store(p, std::memory_order_relaxed);
+}
+
+bool model_t::load_text(const std::string& filename, const load_options& options) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) return false;
+
+    // bulk read, then scan
+    std::string text;
+    in.seekg(0, std::ios::end);
+    std::streamoff size = in.tellg();
+    if (size > 0) {
+        text.resize((size_t)size);
+        in.seekg(0, std::ios::beg);
+        in.read(&text[0], size);
+        text.resize((size_t)in.gcount());
+    }
+
+    std::vector<mod_binary_node> records;
+    records.reserve(text.size() / 64);
+
+    // files from before the pivot columns hold composed translations
+    bool legacy_pivots = false;
+    line_scanner sc;
+    sc.p = text.c_str();
+    while (*sc.p) {
+        mod_binary_node rec;
+        int type, parent;
+        float v[13];
+        bool ok = sc.read_int(type) && sc.read_int(parent);
+        for (int k = 0; ok && k < 13; k++) ok = sc.read_float(v[k]);
+        if (ok) {
+            int level;
+            bool has_level = sc.read_int(level);
+            if (!has_level || level < 0) level = 1;  // older files have no level column
+            bool has_pivot = has_level;
+            for (int k = 0; has_pivot && k < 3; k++) has_pivot = sc.read_float(rec.pivot[k]);
+            if (!has_pivot) {
+                rec.pivot[0] = rec.pivot[1] = rec.pivot[2] = 0.0f;
+                if (records.empty()) legacy_pivots = true;
             }
+            rec.type = type; rec.parent = parent; rec.level = (uint32_t)level;
+            for (int k = 0; k < 3; k++) rec.translation[k] = v[k];
+            for (int k = 0; k < 4; k++) rec.rotation[k] = v[3 + k];
+            for (int k = 0; k < 3; k++) rec.scale[k] = v[7 + k];
+            for (int k = 0; k < 3; k++) rec.color[k] = v[10 + k];
+            rec.color[3] = 1.0f;
+            records.push_back(rec);
+            if (records.size() % 4096 == 0)
+                report_progress(options, TEXT_PARSE_PROGRESS * (sc.p - text.c_str()) / text.size());
         }
-        int type = -1;
-        if (n->shape) type = n->shape->shapetype;
+        sc.next_line();
+    }
+    report_progress(options, TEXT_PARSE_PROGRESS);
+
+    reset();
+    build_nodes(records.data(), records.size(), legacy_pivots, options);
+    return true;
+}
 
-        // Extract transforms (simplified - just translation and scale diagonal)
-        glm::vec3 t(n->translation[3]);
-        glm::vec3 s(n->scale[0][0], n->scale[1][1], n->scale[2][2]);
+bool model_t::save_binary(const std::string& filename, bool embed_meshes) const {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) return false;
+
+    std::vector<model_node*> nodes;
+    std::vector<int32_t> parents;
+    flatten(root, nodes, parents);
 
-        out << type << " " << parentIdx << " "
-            << t.x << " " << t.y << " " << t.z << " "
-            << "0 0 0 1 "  // simplified rotation as identity quaternion
-            << s.x << " " << s.y << " " << s.z << " "
-            << n->color.r << " " << n->color.g << " " << n->color.b << "\n";
+    std::vector<mod_binary_node> records(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) fill_record(nodes[i], parents[i], records[i]);
+
+    mod_binary_header header;
+    memcpy(header.magic, MODB_MAGIC, sizeof(header.magic));
+    header.version = MODB_VERSION;
+    header.node_count = (uint32_t)records.size();
+    header.mesh_count = embed_meshes ? (uint32_t)owned_shapes.size() : 0;
+    header.node_offset = sizeof(mod_binary_header);
+    // pad so the mesh table stays 8-byte aligned whatever the node count
+    uint64_t nodes_end = header.node_offset + records.size() * sizeof(mod_binary_node);
+    header.mesh_offset = (nodes_end + alignof(mod_binary_mesh) - 1) & ~(uint64_t)(alignof(mod_binary_mesh) - 1);
+
+    // mesh table, then blobs packed behind it; meshes whose CPU copy was
+    // released are read back from their GL buffers
+    std::vector<mod_binary_mesh> meshes(header.mesh_count);
+    std::vector<std::vector<glm::vec3> > positions(meshes.size());
+    std::vector<std::vector<GLuint> > indices(meshes.size());
+    uint64_t blob_offset = header.mesh_offset + meshes.size() * sizeof(mod_binary_mesh);
+    for (size_t i = 0; i < meshes.size(); i++) {
+        const shape_t* sh = owned_shapes[i];
+        if (!sh->read_back(positions[i], indices[i])) return false;
+        meshes[i].type = sh->shapetype;
+        meshes[i].level = sh->level;
+        meshes[i].vertex_count = (uint32_t)positions[i].size();
+        meshes[i].index_count = (uint32_t)indices[i].size();
+        meshes[i].vertex_offset = blob_offset;
+        blob_offset += (uint64_t)meshes[i].vertex_count * 3 * sizeof(float);
+        meshes[i].index_offset = blob_offset;
+        blob_offset += (uint64_t)meshes[i].index_count * sizeof(uint32_t);
     }
 
-    return true;
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)records.data(), records.size() * sizeof(mod_binary_node));
+    static const char padding[8] = {};
+    out.write(padding, header.mesh_offset - nodes_end);
+    out.write((const char*)meshes.data(), meshes.size() * sizeof(mod_binary_mesh));
+    for (size_t i = 0; i < meshes.size(); i++) {
+        out.write((const char*)positions[i].data(), positions[i].size() * sizeof(glm::vec3));
+        out.write((const char*)indices[i].data(), indices[i].size() * sizeof(uint32_t));
+    }
+
+    return (bool)out;
 }
 
-bool model_t::load_from_file(const std::string& filename) {
-    std::ifstream in(filename);
-    if (!in) return false;
+bool model_t::load_binary(const std::string& filename, const load_options& options) {
+    mapped_file file;
+    if (!file.open(filename)) return false;
+    if (file.size < sizeof(mod_binary_header)) return false;
 
-    // cleanup old
-    delete root;
-    for (auto s : owned_shapes) delete s;
-    owned_shapes.clear();
-    all_nodes.clear();
+    const mod_binary_header* header = (const mod_binary_header*)file.data;
+    if (memcmp(header->magic, MODB_MAGIC, sizeof(header->magic)) != 0) return false;
+    if (header->version != MODB_VERSION && header->version != 1) return false;
+    size_t node_size = header->version == 1 ? MODB_V1_NODE_SIZE : sizeof(mod_binary_node);
+    if (header->node_offset % alignof(mod_binary_node) != 0 ||
+        header->node_offset + (uint64_t)header->node_count * node_size > file.size ||
+        header->mesh_offset % alignof(mod_binary_mesh) != 0 ||
+        header->mesh_offset + (uint64_t)header->mesh_count * sizeof(mod_binary_mesh) > file.size)
+        return false;
+
+    const mod_binary_node* records = (const mod_binary_node*)(file.data + header->node_offset);
+    std::vector<mod_binary_node> upgraded;
+    if (header->version == 1) {
+        // widen the old 68-byte records; their pivots are filled in by build_nodes
+        upgraded.resize(header->node_count);
+        for (uint32_t i = 0; i < header->node_count; i++) {
+            memcpy(&upgraded[i], file.data + header->node_offset + i * MODB_V1_NODE_SIZE, MODB_V1_NODE_SIZE);
+            upgraded[i].pivot[0] = upgraded[i].pivot[1] = upgraded[i].pivot[2] = 0.0f;
+        }
+        records = upgraded.data();
+    }
+    const mod_binary_mesh* meshes = (const mod_binary_mesh*)(file.data + header->mesh_offset);
 
-    root = new model_node(nullptr,nullptr);
-    all_nodes.push_back(root);
+    reset();
 
-    std::vector<model_node*> nodes;
-    nodes.push_back(root);
-
-    std::string line;
-    while (std::getline(in,line)) {
-        std::istringstream iss(line);
-        int type, parentIdx;
-        float tx,ty,tz, rx,ry,rz,rw, sx,sy,sz, cr,cg,cb;
-        if (!(iss >> type >> parentIdx >> tx >>ty >>tz >> rx>>ry>>rz>>rw >> sx >>sy >>sz >> cr >>cg >>cb))
+    // embedded meshes seed the shared cache before any node asks for them
+    for (uint32_t i = 0; i < header->mesh_count; i++) {
+        const mod_binary_mesh& m = meshes[i];
+        if (m.type < 0 || m.type >= NUM_SHAPE_TYPES) continue;
+        if (m.vertex_offset % alignof(float) != 0 || m.index_offset % alignof(uint32_t) != 0 ||
+            m.vertex_offset + (uint64_t)m.vertex_count * 3 * sizeof(float) > file.size ||
+            m.index_offset + (uint64_t)m.index_count * sizeof(uint32_t) > file.size)
             continue;
+        const shape_t* s = shape_cache_t::instance().acquire(
+            (ShapeType)m.type, m.level,
+            (const float*)(file.data + m.vertex_offset), m.vertex_count,
+            (const GLuint*)(file.data + m.index_offset), m.index_count, options.upload_meshes);
+        if (s) owned_shapes.push_back(s);
+    }
+
+    build_nodes(records, header->node_count, header->version == 1, options);
+    return true;
+}
 
-        shape_t* s = nullptr;
-        switch(type) {
-            case SPHERE_SHAPE: s = new sphere_t(1); break;
-            case CYLINDER_SHAPE: s = new cylinder_t(1); break;
-            case BOX_SHAPE: s = new box_t(); break;
-            case CONE_SHAPE: s = new cone_t(1); break;
+// Create nodes from preorder records. Every distinct mesh is resolved in
+// one batch up front so node creation itself never touches the cache.
+void model_t::build_nodes(const mod_binary_node* records, size_t count, bool legacy_pivots,
+                          const load_options& options) {
+    bool wanted[NUM_SHAPE_TYPES][MAX_TESS_LEVEL + 1] = {};
+    for (size_t i = 0; i < count; i++) {
+        int type = records[i].type;
+        if (type < 0 || type >= NUM_SHAPE_TYPES) continue;
+        wanted[type][shape_cache_t::normalize_level((ShapeType)type, records[i].level)] = true;
+    }
+
+    // meshes this model doesn't hold yet are acquired (and, if new to the
+    // cache, tessellated in parallel) as one batch
+    std::vector<ShapeType> types;
+    std::vector<unsigned int> levels;
+    for (int t = 0; t < NUM_SHAPE_TYPES; t++) {
+        for (unsigned int l = 0; l <= MAX_TESS_LEVEL; l++) {
+            if (!wanted[t][l]) continue;
+            bool owned = false;
+            for (auto s : owned_shapes) owned = owned || (s->shapetype == t && s->level == l);
+            if (owned) continue;
+            types.push_back((ShapeType)t);
+            levels.push_back(l);
         }
-        if (s) owned_shapes.push_back(s);
+    }
+    std::vector<const shape_t*> acquired(types.size());
+    shape_cache_t::instance().acquire_batch(types.data(), levels.data(), types.size(), acquired.data(),
+                                            options.upload_meshes);
+    for (auto s : acquired) if (s) owned_shapes.push_back(s);
+
+    const shape_t* shapes[NUM_SHAPE_TYPES][MAX_TESS_LEVEL + 1] = {};
+    for (int t = 0; t < NUM_SHAPE_TYPES; t++)
+        for (unsigned int l = 0; l <= MAX_TESS_LEVEL; l++)
+            if (wanted[t][l]) shapes[t][l] = get_shape((ShapeType)t, l);
+
+    // node building covers whatever progress the caller hasn't reported yet
+    float progress_base = options.progress ? options.progress->load(std::memory_order_relaxed) : 0.0f;
 
-        model_node* parent = (parentIdx >=0 && parentIdx < (int)nodes.size())
-                             ? nodes[parentIdx] : root;
+    std::vector<model_node*> nodes(count, nullptr);
+    all_nodes.reserve(all_nodes.size() + count);
+    slots.reserve(slots.size() + count);
+    for (size_t i = 0; i < count; i++) {
+        const mod_binary_node& rec = records[i];
 
-        model_node* node = new model_node(s,parent);
-        node->translation = glm::translate(glm::mat4(1.0f), glm::vec3(tx,ty,tz));
-        node->scale = glm::scale(glm::mat4(1.0f), glm::vec3(sx,sy,sz));
-        node->color = glm::vec4(cr,cg,cb,1.0f);
+        model_node* node;
+        if (rec.parent < 0 && i == 0) {
+            node = root;
+        } else {
+            const shape_t* s = nullptr;
+            if (rec.type >= 0 && rec.type < NUM_SHAPE_TYPES)
+                s = shapes[rec.type][shape_cache_t::normalize_level((ShapeType)rec.type, rec.level)];
+            model_node* parent = (rec.parent >= 0 && (size_t)rec.parent < i) ? nodes[rec.parent] : root;
+            node = new_node(s, parent);
+        }
 
-        nodes.push_back(node);
-        all_nodes.push_back(node);
+        glm::quat r(rec.rotation[3], rec.rotation[0], rec.rotation[1], rec.rotation[2]);
+        float len2 = glm::dot(r, r);
+        r = len2 > 0.0f ? glm::normalize(r) : glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+        node->translation = glm::vec3(rec.translation[0], rec.translation[1], rec.translation[2]);
+        node->rotation = r;
+        node->scale = glm::vec3(rec.scale[0], rec.scale[1], rec.scale[2]);
+        node->pivot = glm::vec3(rec.pivot[0], rec.pivot[1], rec.pivot[2]);
+        node->color = glm::vec4(rec.color[0], rec.color[1], rec.color[2], rec.color[3]);
+        // old files store the composed transform about the origin; move the
+        // pivot back to the centroid so edits turn the shape in place
+        if (legacy_pivots && node->shape) node->set_pivot(node->shape->centroid);
+        node->mark_dirty();
+        nodes[i] = node;
+        if ((i + 1) % 4096 == 0) report_progress(options, progress_base + (1.0f - progress_base) * (i + 1) / count);
     }
 
-    return true;
+    update_world_matrices();
+    report_progress(options, 1.0f);
+}
+
+// Drop all nodes and shape handles, leaving an empty root
+void model_t::reset() {
+    clear_nodes();
+    release_shapes();
+
+    root = new_node(nullptr, nullptr);
+}
+
+model_stats model_t::stats() const {
+    model_stats s;
+    s.nodes = all_nodes.size();
+    s.shaped_nodes = 0;
+    s.triangles = 0;
+    s.mesh_cpu_bytes = s.mesh_gpu_bytes = 0;
+    s.frozen_subtrees = frozen.size();
+    s.frozen_gpu_bytes = 0;
+
+    for (auto shape : owned_shapes) {
+        mesh_stats m;
+        m.type = shape->shapetype;
+        m.level = shape->level;
+        m.vertices = shape->vertex_count;
+        m.triangles = shape->index_count / 3;
+        m.nodes = 0;
+        m.cpu_bytes = shape->vertices.capacity() * sizeof(glm::vec3) + shape->indices.capacity() * sizeof(GLuint);
+        m.gpu_bytes = 0;
+        if (shape->buffers_initialized) {
+            m.gpu_bytes = shape->vertex_count * vertex_format_stride(shape->vertex_format) +
+                          shape->index_count * (shape->index_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint));
+        }
+        s.mesh_cpu_bytes += m.cpu_bytes;
+        s.mesh_gpu_bytes += m.gpu_bytes;
+        s.meshes.push_back(m);
+    }
+    for (auto n : all_nodes) {
+        if (!n->shape) continue;
+        s.shaped_nodes++;
+        s.triangles += n->shape->index_count / 3;
+        for (size_t i = 0; i < owned_shapes.size(); i++) {
+            if (owned_shapes[i] == n->shape) { s.meshes[i].nodes++; break; }
+        }
+    }
+    for (auto f : frozen) s.frozen_gpu_bytes += f->vertex_count * sizeof(baked_vertex) + f->index_count * sizeof(GLuint);
+
+    s.node_bytes = chunks.size() * NODES_PER_CHUNK * sizeof(model_node) +
+                   chunks.capacity() * sizeof(model_node*) +
+                   all_nodes.capacity() * sizeof(model_node*) +
+                   slots.capacity() * sizeof(node_slot) +
+                   free_slots.capacity() * sizeof(uint32_t) +
+                   by_id.capacity() * sizeof(model_node*) +
+                   flat.nodes.capacity() * sizeof(model_node*) + flat.parent.capacity() * sizeof(int32_t) +
+                   flat.child_begin.capacity() * sizeof(uint32_t) + flat.level_start.capacity() * sizeof(uint32_t) +
+                   flat.changed.capacity();
+    return s;
+}
+
+std::string model_stats::to_json() const {
+    static const char* const TYPE_NAMES[NUM_SHAPE_TYPES] = { "sphere", "cylinder", "box", "cone" };
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "{\"nodes\":%zu,\"shaped_nodes\":%zu,\"triangles\":%zu,\"node_bytes\":%zu,"
+             "\"mesh_cpu_bytes\":%zu,\"mesh_gpu_bytes\":%zu,\"frozen_subtrees\":%zu,\"frozen_gpu_bytes\":%zu,\"meshes\":[",
+             nodes, shaped_nodes, triangles, node_bytes, mesh_cpu_bytes, mesh_gpu_bytes, frozen_subtrees, frozen_gpu_bytes);
+    std::string out = buf;
+    for (size_t i = 0; i < meshes.size(); i++) {
+        const mesh_stats& m = meshes[i];
+        snprintf(buf, sizeof(buf),
+                 "%s{\"type\":\"%s\",\"level\":%u,\"vertices\":%zu,\"triangles\":%zu,\"nodes\":%zu,"
+                 "\"cpu_bytes\":%zu,\"gpu_bytes\":%zu}",
+                 i ? "," : "", m.type >= 0 && m.type < NUM_SHAPE_TYPES ? TYPE_NAMES[m.type] : "?",
+                 m.level, m.vertices, m.triangles, m.nodes, m.cpu_bytes, m.gpu_bytes);
+        out += buf;
+    }
+    out += "]}";
+    return out;
 }
 
 void model_t::debug_print() const {
@@ -207,6 +1136,6 @@ void model_t::debug_print() const {
     for (size_t i=0;i<nodes.size();i++) {
         auto n = nodes[i];
         std::cout<<"Node "<<i<<" type="<<(n->shape? n->shape->shapetype:-1)
-                 <<" children="<<n->children.size()<<"\n";
+                 <<" children="<<n->child_count<<"\n";
     }
 }
\ No newline at end of file
@@ -1,37 +1,170 @@
 #ifndef MODEL_HPP
 #define MODEL_HPP
 
+#include <atomic>
 #include <vector>
 #include <string>
+#include <cstdint>
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include "shape.hpp"
 
+struct mod_binary_node;     // on-disk node record, see model.cpp
+
+// Stable reference to a node. Resolves to null once the node is removed,
+// even after its slot has been reused by a newer node.
+struct node_handle {
+    uint32_t index;
+    uint32_t generation;
+
+    node_handle() : index(0xFFFFFFFFu), generation(0) {}
+    node_handle(uint32_t i, uint32_t g) : index(i), generation(g) {}
+};
+
+static const uint32_t NO_NODE_ID = 0xFFFFFFFFu;
+
+// How load_from_file() runs. With upload_meshes false, meshes new to the
+// shape cache are left for shape_cache_t::upload_pending(), so the load
+// may run on a thread without a GL context. progress goes 0..1.
+struct load_options {
+    bool upload_meshes;
+    std::atomic<float>* progress;
+
+    load_options() : upload_meshes(true), progress(nullptr) {}
+};
+
+// Running sum of node centroids. Kept in double so that the add/remove
+// pairs from many edits don't drift.
+struct centroid_sum {
+    double x, y, z;
+    uint32_t count;
+
+    centroid_sum() : x(0.0), y(0.0), z(0.0), count(0) {}
+    void add(const glm::vec3& p) { x += p.x; y += p.y; z += p.z; count++; }
+    void remove(const glm::vec3& p) { x -= p.x; y -= p.y; z -= p.z; count--; }
+    // count wraps like the add/remove pairs, so a partial sum of mostly
+    // removals still merges correctly
+    void merge(const centroid_sum& o) { x += o.x; y += o.y; z += o.z; count += o.count; }
+};
+
+struct model_node;
+
+// A frozen subtree: the shapes of every node in it, merged into one mesh
+// in the root's space with per-vertex colors, drawn with one call at the
+// root's world matrix. See model_t::freeze().
+struct frozen_subtree {
+    model_node* root;       // null once the root was removed
+    bool stale;             // a node inside changed; unfrozen by sync_frozen()
+    GLuint vao, vbo, ebo;
+    GLsizei index_count;
+    size_t vertex_count;
+    size_t node_count;      // nodes with a shape merged into the mesh
+};
+
+// Vertex of a frozen subtree's mesh: position in the root's space and an
+// RGBA8 color (attribute locations 0 and 5)
+struct baked_vertex {
+    glm::vec3 position;
+    uint8_t color[4];
+};
+
+// One mesh a model holds a reference to, see model_t::stats()
+struct mesh_stats {
+    ShapeType type;
+    unsigned int level;
+    size_t vertices, triangles;
+    size_t nodes;               // nodes drawing it as their own shape
+    size_t cpu_bytes;           // CPU copy, 0 once released
+    size_t gpu_bytes;           // vertex + index buffers
+};
+
+// Size of a model and what it holds. Meshes are shared through
+// shape_cache_t, so another model using the same mesh counts it too.
+struct model_stats {
+    size_t nodes;               // root included
+    size_t shaped_nodes;
+    size_t triangles;           // over shaped nodes, at their own mesh's level
+    size_t node_bytes;          // node pool plus the per-node bookkeeping arrays
+    size_t mesh_cpu_bytes, mesh_gpu_bytes;
+    size_t frozen_subtrees;
+    size_t frozen_gpu_bytes;
+    std::vector<mesh_stats> meshes;
+
+    std::string to_json() const;    // one line, no trailing newline
+};
+
 // A hierarchical model node
 struct model_node {
-    shape_t* shape;             // may be null
-    glm::mat4 translation;
-    glm::mat4 rotation;
-    glm::mat4 scale;
+    const shape_t* shape;       // shared via shape_cache_t, may be null
+
+    // Local transform: scale, then rotation, both about pivot, then
+    // translation. New nodes pivot on their shape's centroid.
+    glm::vec3 translation;
+    glm::quat rotation;
+    glm::vec3 scale;
+    glm::vec3 pivot;
     glm::vec4 color;
     model_node* parent;
-    std::vector<model_node*> children;
 
-    model_node(shape_t* s = nullptr, model_node* p = nullptr);
-    ~model_node();
+    // Children as an intrusive, ordered sibling list
+    model_node* first_child;
+    model_node* last_child;
+    model_node* prev_sibling;
+    model_node* next_sibling;
+    uint32_t child_count;
 
-    void add_child(model_node* c);
-    void remove_child(model_node* c);
+    // Cached transform, refreshed by model_t::update_world_matrices()
+    glm::mat4 world;
+    bool dirty;                 // translation/rotation/scale edited
+    bool subtree_dirty;         // this node or a descendant is dirty
+
+    // World-space AABBs, refreshed together with the world matrices.
+    // Empty boxes have min > max.
+    glm::vec3 bounds_min, bounds_max;     // this node's shape
+    glm::vec3 subtree_min, subtree_max;   // this node and its descendants
+
+    // World-space shape centroid, and whether it is in model_t's sum
+    glm::vec3 world_centroid;
+    bool in_centroid_sum;
+
+    unsigned int lod_level;     // level last picked by the renderer's LOD mode
+    frozen_subtree* frozen;     // set while this node is part of a frozen subtree
+
+    // Bookkeeping owned by model_t, all O(1) to update
+    uint32_t list_index;        // position in model_t::all_nodes
+    uint32_t slot;              // handle slot == position in the node pool
+    uint32_t id;                // see model_t::find()
+    model_node* prev_created;   // creation order
+    model_node* next_created;
+
+    // Nodes live in model_t's pool; create them with model_t::create_*
+    model_node(const shape_t* s = nullptr, model_node* p = nullptr);
+
+    void add_child(model_node* c);      // appends, O(1)
+    void insert_child(model_node* c, model_node* before);  // before null appends, O(1)
+    void remove_child(model_node* c);   // unlinks, O(1)
 
     glm::mat4 local_matrix() const;
-    glm::mat4 get_world_matrix() const;  // Added: computes world transform
+    const glm::mat4& get_world_matrix() const;  // cached, valid after update_world_matrices()
+    // Rotates the node by q about point, given in the parent's space
+    void rotate_about(const glm::quat& q, const glm::vec3& point);
+    // Moves the pivot without changing the local matrix
+    void set_pivot(const glm::vec3& p);
+    void set_color(const glm::vec4& c);    // use instead of writing color in a frozen subtree
+    void mark_dirty();          // call after editing translation/rotation/scale/pivot
+    void mark_subtree_dirty();  // descendants changed (e.g. one was removed)
+    void update_world(const glm::mat4& parent_world, bool parent_changed, centroid_sum& centroids);
+    // world matrix, own bounds and centroid from the parent's world matrix
+    void refresh_world(const glm::mat4* parent_world, centroid_sum& centroids);
     void collect(std::vector<model_node*>& out);
 };
 
 class model_t {
 public:
     model_node* root;
-    std::vector<model_node*> all_nodes; // flat list for bookkeeping
-    std::vector<shape_t*> owned_shapes;
+    std::vector<model_node*> all_nodes; // flat list for bookkeeping, unordered
+    std::vector<const shape_t*> owned_shapes; // cache handles, one per (type, level) in use
+    bool parallel_update;   // large models update level by level on the thread pool
 
     model_t();
     ~model_t();
@@ -41,12 +174,125 @@ public:
     model_node* create_box(model_node* parent = nullptr);
     model_node* create_cone(unsigned int level = 1, model_node* parent = nullptr);
 
-    void remove_node(model_node* node);
+    void remove_node(model_node* node);     // O(subtree size)
+
+    // Node ids number the nodes in save order after a load or
+    // renumber_ids(); new nodes take the next unused id. Unlike a handle,
+    // an id can be handed back to a node rebuilt by restore_node(), so edit
+    // histories and journals refer to nodes by id.
+    model_node* find(uint32_t id) const;
+    // Recreates a removed node under parent, before the given sibling (null
+    // appends). Null if the id is in use.
+    model_node* restore_node(uint32_t id, const shape_t* shape, model_node* parent, model_node* before);
+    // Ids become preorder positions, as a reload of a fresh save would give
+    // them; remap[old id] is the new id or NO_NODE_ID for removed nodes.
+    void renumber_ids(std::vector<uint32_t>& remap);
+    uint32_t reserve_id() { by_id.push_back(nullptr); return next_id++; }  // never handed out again
+
+    node_handle handle_of(const model_node* node) const;
+    model_node* get(node_handle h) const;   // null if the node is gone
+    model_node* last_created() const { return newest; }
+    model_node* previous_created(const model_node* node) const;  // never the root
+
+    // The model's handle for (type, level), acquired from the shared cache
+    // on first use and held until the model is cleared
+    const shape_t* get_shape(ShapeType type, unsigned int level);
+    void update_world_matrices();   // top-down pass over dirty subtrees only
+
+    // Every node in breadth-first order (parents before children), cached
+    // until the tree's structure changes
+    const std::vector<model_node*>& flat_nodes();
+
+    // Change stamps for caches built from the model: the first changes
+    // when nodes are added or removed, the second when
+    // update_world_matrices() moves anything. Stamps are unique across all
+    // models, so a new model at a reused address never matches.
+    uint64_t structure_stamp();
+    uint64_t world_stamp();
 
-    bool save_to_file(const std::string& filename) const;
-    bool load_from_file(const std::string& filename);
+    // Freezing merges the subtree's shapes into one mesh, pre-transformed
+    // into node's space and colored per vertex, that the renderer draws
+    // with a single call. Moving node itself keeps it frozen; editing,
+    // recoloring or removing any node below it unfreezes the subtree at the
+    // next sync_frozen(). Children added later draw on their own. With
+    // at_lod_level each node is baked at the level the renderer's LOD mode
+    // last picked for it, and keeps it until unfrozen. Needs the GL
+    // context. False if node is already frozen or has no shapes below.
+    bool freeze(model_node* node, bool at_lod_level = false);
+    void unfreeze(model_node* node);    // node: the root passed to freeze()
+    void sync_frozen();                 // unfreezes stale subtrees; GL thread
+    const std::vector<frozen_subtree*>& frozen_subtrees() const { return frozen; }
+
+    // Mean of the nodes' world-space shape centroids and the world AABB of
+    // the whole model. Both are kept up to date by update_world_matrices(),
+    // so they cost nothing until the model is edited. bounds() returns
+    // false for a model without shapes.
+    glm::vec3 centroid();
+    bool bounds(glm::vec3& min, glm::vec3& max);
+
+    // ".modb" selects the binary format, anything else the text format
+    bool save_to_file(const std::string& filename, bool embed_meshes = false) const;
+    bool load_from_file(const std::string& filename, const load_options& options = load_options());
 
     void debug_print() const;
+    model_stats stats() const;      // O(nodes)
+
+private:
+    // Node pool: fixed-size chunks of raw storage addressed by slot index.
+    // Removed slots go on a free list; reset() keeps the chunks for reuse.
+    static const uint32_t NODES_PER_CHUNK = 1024;
+    std::vector<model_node*> chunks;
+
+    struct node_slot {
+        model_node* node;       // null while the slot is free
+        uint32_t generation;
+    };
+    std::vector<node_slot> slots;
+    std::vector<uint32_t> free_slots;
+    model_node* newest;         // tail of the creation-order list
+    std::vector<model_node*> by_id;     // null where the node is gone
+    uint32_t next_id;
+    uint64_t structure_stamp_value;     // 0 = changed, a fresh stamp is due
+    uint64_t world_stamp_value;
+    std::vector<frozen_subtree*> frozen;
+    void destroy_frozen(frozen_subtree* f);
+    centroid_sum centroids;     // over nodes with in_centroid_sum set
+
+    // Breadth-first flattening of the tree. Level l is the index range
+    // [level_start[l], level_start[l+1]); a node's children are contiguous
+    // in the next level, starting at child_begin.
+    struct flat_tree {
+        std::vector<model_node*> nodes;
+        std::vector<int32_t> parent;        // index in nodes, -1 for the root
+        std::vector<uint32_t> child_begin;
+        std::vector<uint32_t> level_start;
+        std::vector<uint8_t> changed;       // world matrix refreshed this update
+        bool valid;
+
+        flat_tree() : valid(false) {}
+    };
+    flat_tree flat;
+    void build_flat();
+    void update_world_levels();
+
+    model_t(const model_t&);
+    model_t& operator=(const model_t&);
+
+    model_node* new_node(const shape_t* s, model_node* parent);
+    void free_node(model_node* n);
+    void clear_nodes();
+    void free_chunks();
+
+    void release_shapes();
+    void reset();
+
+    bool save_text(const std::string& filename) const;
+    bool load_text(const std::string& filename, const load_options& options);
+    bool save_binary(const std::string& filename, bool embed_meshes) const;
+    bool load_binary(const std::string& filename, const load_options& options);
+    // legacy_pivots: the records come from a file without pivots
+    void build_nodes(const mod_binary_node* records, size_t count, bool legacy_pivots,
+                     const load_options& options);
 };
 
 #endif // MODEL_HPP
\ No newline at end of file
@@ -0,0 +1,183 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+profiler_t::profiler_t()
+    : enabled(false), frames_started(0), has_prev_frame(false), in_frame(false),
+      history_next(0), query_index(0), query_active(false) {
+    memset(&current, 0, sizeof(current));
+    queries[0] = queries[1] = 0;
+    query_pending[0] = query_pending[1] = false;
+    query_slot[0] = query_slot[1] = 0;
+    history.reserve(HISTORY_FRAMES);
+}
+
+profiler_t::~profiler_t() {
+    shutdown();
+}
+
+bool profiler_t::init() {
+    if (!queries[0]) glGenQueries(2, queries);
+    return queries[0] != 0;
+}
+
+void profiler_t::shutdown() {
+    if (queries[0]) {
+        glDeleteQueries(2, queries);
+        queries[0] = queries[1] = 0;
+    }
+    query_pending[0] = query_pending[1] = false;
+    query_active = false;
+}
+
+void profiler_t::begin_frame() {
+    current.draw_calls = 0;
+    current.triangles = 0;
+    current.state_changes = 0;
+    if (!enabled) {
+        has_prev_frame = false;  // don't count the paused time as a frame
+        return;
+    }
+    frame_start = clock::now();
+    memset(&current, 0, sizeof(current));
+    current.frame = frames_started++;
+    current.gpu_ms = -1.0;
+    current.frame_ms = has_prev_frame
+        ? std::chrono::duration<double, std::milli>(frame_start - prev_frame_start).count() : 0.0;
+    prev_frame_start = frame_start;
+    has_prev_frame = true;
+    in_frame = true;
+}
+
+void profiler_t::end_frame() {
+    last.draw_calls = current.draw_calls;
+    last.triangles = current.triangles;
+    last.state_changes = current.state_changes;
+    if (!in_frame) return;
+    in_frame = false;
+    current.cpu_ms = std::chrono::duration<double, std::milli>(clock::now() - frame_start).count();
+
+    if (history.size() < HISTORY_FRAMES) history.push_back(current);
+    else history[history_next] = current;
+    history_next = (history_next + 1) % HISTORY_FRAMES;
+
+    // the previous frame's query has usually landed by now; never wait for it
+    if (query_pending[query_index] && collect_gpu_result(query_index)) query_pending[query_index] = false;
+}
+
+void profiler_t::gpu_begin() {
+    if (!enabled || !in_frame || !queries[0] || query_active) return;
+    // this query object is about to be reused; a result still in flight is dropped
+    if (query_pending[query_index]) {
+        collect_gpu_result(query_index);
+        query_pending[query_index] = false;
+    }
+    glBeginQuery(GL_TIME_ELAPSED, queries[query_index]);
+    query_active = true;
+}
+
+void profiler_t::gpu_end() {
+    if (!query_active) return;
+    glEndQuery(GL_TIME_ELAPSED);
+    query_active = false;
+    query_pending[query_index] = true;
+    query_slot[query_index] = history_next;  // where end_frame will store this frame
+    query_index ^= 1;
+}
+
+bool profiler_t::collect_gpu_result(unsigned int qi) {
+    GLint available = 0;
+    glGetQueryObjectiv(queries[qi], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return false;
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(queries[qi], GL_QUERY_RESULT, &ns);
+    if (query_slot[qi] < history.size()) history[query_slot[qi]].gpu_ms = ns / 1.0e6;
+    return true;
+}
+
+void profiler_t::add_time(ProfileSection s, double ms) {
+    if (in_frame) current.section_ms[s] += ms;
+}
+
+const frame_stats& profiler_t::frame(size_t age) const {
+    size_t n = history.size();
+    return history[(history_next + n - 1 - age % n) % n];
+}
+
+void profiler_t::histogram(unsigned int buckets[HISTOGRAM_BUCKETS]) const {
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) buckets[i] = 0;
+    for (const auto& f : history) {
+        if (f.frame_ms <= 0.0) continue;  // first frame after enabling has no interval
+        unsigned int b = (unsigned int)f.frame_ms;
+        buckets[b < HISTOGRAM_BUCKETS ? b : HISTOGRAM_BUCKETS - 1]++;
+    }
+}
+
+double profiler_t::percentile_frame_ms(double p) const {
+    std::vector<double> times;
+    times.reserve(history.size());
+    for (const auto& f : history) if (f.frame_ms > 0.0) times.push_back(f.frame_ms);
+    if (times.empty()) return 0.0;
+    size_t k = (size_t)(p * (times.size() - 1) + 0.5);
+    std::nth_element(times.begin(), times.begin() + k, times.end());
+    return times[k];
+}
+
+std::string profiler_t::hud_text() const {
+    if (history.empty()) return "profiling";
+
+    // averages over the last second or so
+    size_t n = std::min<size_t>(history.size(), 60);
+    double frame_ms = 0, cpu = 0, sec[NUM_PROFILE_SECTIONS] = {0}, gpu = 0;
+    size_t timed = 0, gpu_frames = 0;
+    for (size_t i = 0; i < n; i++) {
+        const frame_stats& f = frame(i);
+        if (f.frame_ms > 0.0) { frame_ms += f.frame_ms; timed++; }
+        cpu += f.cpu_ms;
+        for (int s = 0; s < NUM_PROFILE_SECTIONS; s++) sec[s] += f.section_ms[s];
+        if (f.gpu_ms >= 0.0) { gpu += f.gpu_ms; gpu_frames++; }
+    }
+    if (timed) frame_ms /= timed;
+    cpu /= n;
+    for (int s = 0; s < NUM_PROFILE_SECTIONS; s++) sec[s] /= n;
+
+    const frame_stats& last = frame(0);
+    char buf[256];
+    char gpu_text[32];
+    if (gpu_frames) snprintf(gpu_text, sizeof(gpu_text), "%.2f ms", gpu / gpu_frames);
+    else snprintf(gpu_text, sizeof(gpu_text), "n/a");
+    snprintf(buf, sizeof(buf),
+             "%.2f ms (%.0f fps) p99 %.2f | cpu %.2f: upd %.2f trav %.2f sub %.2f | gpu %s | %u draws %lu tris %u state",
+             frame_ms, frame_ms > 0.0 ? 1000.0 / frame_ms : 0.0, percentile_frame_ms(0.99),
+             cpu, sec[PROFILE_UPDATE], sec[PROFILE_TRAVERSE], sec[PROFILE_SUBMIT], gpu_text,
+             last.draw_calls, last.triangles, last.state_changes);
+    return buf;
+}
+
+bool profiler_t::write_csv(const std::string& frames_file, const std::string& histogram_file) const {
+    FILE* f = fopen(frames_file.c_str(), "w");
+    if (!f) return false;
+    fprintf(f, "frame,frame_ms,cpu_ms,update_ms,traverse_ms,submit_ms,gpu_ms,draw_calls,triangles,state_changes\n");
+    for (size_t age = history.size(); age-- > 0; ) {
+        const frame_stats& s = frame(age);
+        fprintf(f, "%lu,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%u,%lu,%u\n",
+                s.frame, s.frame_ms, s.cpu_ms, s.section_ms[PROFILE_UPDATE], s.section_ms[PROFILE_TRAVERSE],
+                s.section_ms[PROFILE_SUBMIT], s.gpu_ms, s.draw_calls, s.triangles, s.state_changes);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+
+    f = fopen(histogram_file.c_str(), "w");
+    if (!f) return false;
+    unsigned int buckets[HISTOGRAM_BUCKETS];
+    histogram(buckets);
+    fprintf(f, "from_ms,to_ms,frames\n");
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (i + 1 < HISTOGRAM_BUCKETS) fprintf(f, "%u,%u,%u\n", i, i + 1, buckets[i]);
+        else fprintf(f, "%u,,%u\n", i, buckets[i]);
+    }
+    ok = ok && !ferror(f);
+    fclose(f);
+    return ok;
+}
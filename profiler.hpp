@@ -0,0 +1,125 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <GL/glew.h>
+
+// CPU sections timed inside a frame
+enum ProfileSection {
+    PROFILE_UPDATE,     // world matrix / bounds propagation
+    PROFILE_TRAVERSE,   // culling walk + LOD selection
+    PROFILE_SUBMIT,     // batching, uploads and draw calls
+    NUM_PROFILE_SECTIONS
+};
+
+struct frame_stats {
+    unsigned long frame;                // running frame number
+    double frame_ms;                    // time since the previous begin_frame
+    double cpu_ms;                      // begin_frame -> end_frame
+    double section_ms[NUM_PROFILE_SECTIONS];
+    double gpu_ms;                      // GL_TIME_ELAPSED, < 0 while unavailable
+    unsigned int draw_calls;
+    unsigned long triangles;
+    unsigned int state_changes;         // program, VAO and buffer binds/uploads
+};
+
+// Draw counters of one frame
+struct draw_counts {
+    unsigned int draw_calls;
+    unsigned long triangles;
+    unsigned int state_changes;
+
+    draw_counts() : draw_calls(0), triangles(0), state_changes(0) {}
+};
+
+// Per-frame CPU/GPU timings and draw counters with a rolling history.
+// GPU timer queries are double-buffered: a frame's result is read back one
+// frame later, so the pipeline never stalls on it.
+class profiler_t {
+public:
+    static const size_t HISTORY_FRAMES = 600;
+    static const unsigned int HISTOGRAM_BUCKETS = 34;  // 1 ms wide, the last is 33+ ms
+
+    bool enabled;
+
+    profiler_t();
+    ~profiler_t();
+
+    bool init();        // creates timer queries; needs a current GL context
+    void shutdown();
+
+    void begin_frame();
+    void end_frame();
+    void gpu_begin();   // bracket the GL work to time; at most once per frame
+    void gpu_end();
+
+    void add_time(ProfileSection s, double ms);
+    // counted even while disabled, for last_counts()
+    void count_draw(unsigned long triangles) {
+        current.draw_calls++;
+        current.triangles += triangles;
+    }
+    void count_state_change(unsigned int n = 1) {
+        current.state_changes += n;
+    }
+    // last frame finished with end_frame(), whether or not enabled
+    const draw_counts& last_counts() const { return last; }
+
+    size_t frame_count() const { return history.size(); }
+    const frame_stats& frame(size_t age) const;     // 0 = most recent finished frame
+
+    void histogram(unsigned int buckets[HISTOGRAM_BUCKETS]) const;
+    double percentile_frame_ms(double p) const;
+    std::string hud_text() const;                   // one line, for the window title
+
+    bool write_csv(const std::string& frames_file, const std::string& histogram_file) const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    frame_stats current;
+    draw_counts last;
+    unsigned long frames_started;
+    clock::time_point frame_start, prev_frame_start;
+    bool has_prev_frame;
+    bool in_frame;
+
+    std::vector<frame_stats> history;   // ring buffer of finished frames
+    size_t history_next;
+
+    // query[i] was issued in the frame whose history slot is query_slot[i]
+    GLuint queries[2];
+    bool query_pending[2];
+    size_t query_slot[2];
+    unsigned int query_index;
+    bool query_active;
+
+    bool collect_gpu_result(unsigned int qi);
+};
+
+// Adds the lifetime of the scope to a profiler section
+class scoped_timer {
+public:
+    scoped_timer(profiler_t* p, ProfileSection s)
+        : profiler(p && p->enabled ? p : nullptr), section(s) {
+        if (profiler) start = std::chrono::steady_clock::now();
+    }
+    ~scoped_timer() {
+        if (profiler) {
+            std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - start;
+            profiler->add_time(section, d.count());
+        }
+    }
+
+private:
+    profiler_t* profiler;
+    ProfileSection section;
+    std::chrono::steady_clock::time_point start;
+
+    scoped_timer(const scoped_timer&);
+    scoped_timer& operator=(const scoped_timer&);
+};
+
+#endif // PROFILER_HPP
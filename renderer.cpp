@@ -0,0 +1,878 @@
+#include "renderer.hpp"
+#include "shader.hpp"
+#include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+
+// Built-in copies of the shaders/ files, used when those aren't found
+static const char* vertex_shader_source = R"(
+#version 330 core
+layout (location = 0) in vec3 aPos;
+
+uniform mat4 uMVP;
+
+void main() {
+    gl_Position = uMVP * vec4(aPos, 1.0);
+}
+)";
+
+static const char* fragment_shader_source = R"(
+#version 330 core
+out vec4 FragColor;
+
+uniform vec4 uColor;
+
+void main() {
+    FragColor = uColor;
+}
+)";
+
+// Instanced variant: model matrix and color come from per-instance attributes
+static const char* instanced_vertex_shader_source = R"(
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in mat4 aModel;
+layout (location = 5) in vec4 aColor;
+
+uniform mat4 uViewProj;
+
+out vec4 vColor;
+
+void main() {
+    gl_Position = uViewProj * aModel * vec4(aPos, 1.0);
+    vColor = aColor;
+}
+)";
+
+// Frozen subtrees: positions are in the frozen root's space, colors per vertex
+static const char* baked_vertex_shader_source = R"(
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 5) in vec4 aColor;
+
+uniform mat4 uMVP;
+
+out vec4 vColor;
+
+void main() {
+    gl_Position = uMVP * vec4(aPos, 1.0);
+    vColor = aColor;
+}
+)";
+
+static const char* procedural_vertex_shader_source = R"(
+#version 330 core
+// No vertex buffer: the corner is rebuilt from gl_VertexID, in the same
+// triangle order as the meshes shape.cpp generates
+layout (location = 1) in mat4 aModel;
+layout (location = 5) in vec4 aColor;
+
+uniform mat4 uViewProj;
+uniform int uType;      // ShapeType
+uniform int uSlices;
+uniform int uStacks;    // spheres only
+
+out vec4 vColor;
+
+const float PI = 3.14159265358979;
+
+const int BOX_INDICES[36] = int[36](0,1,2, 0,2,3, 4,7,6, 4,6,5, 0,4,5, 0,5,1,
+                                    2,6,7, 2,7,3, 0,3,7, 0,7,4, 1,5,6, 1,6,2);
+
+vec3 ring_point(int j, float radius, float y) {
+    float theta = 2.0 * PI * float(j % uSlices) / float(uSlices);
+    return vec3(radius * cos(theta), y, radius * sin(theta));
+}
+
+// ring i of 0..uStacks, poles included
+vec3 sphere_point(int i, int j) {
+    float phi = PI * float(i) / float(uStacks);
+    return ring_point(j, sin(phi), cos(phi));
+}
+
+vec3 sphere_corner(int t, int c) {
+    int cap = uSlices, band = 2 * uSlices * (uStacks - 2);
+    if (t < cap) {
+        // north cap: pole, ring(1, j), ring(1, j+1)
+        return c == 0 ? vec3(0.0, 1.0, 0.0) : sphere_point(1, t + c - 1);
+    }
+    t -= cap;
+    if (t < band) {
+        int i = 2 + t / (2 * uSlices);
+        int q = t % (2 * uSlices);
+        int j = q / 2;
+        // (p1, p2, p3) then (p1, p3, p4) with p1 = ring(i-1, j),
+        // p2 = ring(i, j), p3 = ring(i, j+1), p4 = ring(i-1, j+1)
+        if (c == 0) return sphere_point(i - 1, j);
+        if ((q & 1) == 0) return sphere_point(i, j + c - 1);
+        return c == 1 ? sphere_point(i, j + 1) : sphere_point(i - 1, j + 1);
+    }
+    t -= band;
+    // south cap: ring(stacks-1, j), pole, ring(stacks-1, j+1)
+    if (c == 1) return vec3(0.0, -1.0, 0.0);
+    return sphere_point(uStacks - 1, t + c / 2);
+}
+
+vec3 cylinder_corner(int t, int c) {
+    int j = t / 4, k = t % 4;
+    vec3 b1 = ring_point(j, 0.5, -0.5), b2 = ring_point(j + 1, 0.5, -0.5);
+    vec3 t1 = ring_point(j, 0.5, 0.5), t2 = ring_point(j + 1, 0.5, 0.5);
+    if (k == 0) return c == 0 ? b1 : (c == 1 ? b2 : t2);
+    if (k == 1) return c == 0 ? b1 : (c == 1 ? t2 : t1);
+    if (k == 2) return c == 0 ? vec3(0.0, -0.5, 0.0) : (c == 1 ? b1 : b2);
+    return c == 0 ? vec3(0.0, 0.5, 0.0) : (c == 1 ? t2 : t1);
+}
+
+vec3 cone_corner(int t, int c) {
+    int j = t / 2;
+    vec3 b1 = ring_point(j, 0.5, -0.5), b2 = ring_point(j + 1, 0.5, -0.5);
+    if ((t & 1) == 0) return c == 0 ? vec3(0.0, 0.5, 0.0) : (c == 1 ? b1 : b2);
+    return c == 0 ? vec3(0.0, -0.5, 0.0) : (c == 1 ? b2 : b1);
+}
+
+vec3 box_corner(int k) {
+    return vec3(float((k + 1) >> 1 & 1), float(k >> 1 & 1), float(k >> 2)) - 0.5;
+}
+
+void main() {
+    int t = gl_VertexID / 3, c = gl_VertexID % 3;
+    vec3 p;
+    if (uType == 0) p = sphere_corner(t, c);
+    else if (uType == 1) p = cylinder_corner(t, c);
+    else if (uType == 2) p = box_corner(BOX_INDICES[gl_VertexID]);
+    else p = cone_corner(t, c);
+    gl_Position = uViewProj * aModel * vec4(p, 1.0);
+    vColor = aColor;
+}
+)";
+
+static const char* instanced_fragment_shader_source = R"(
+#version 330 core
+in vec4 vColor;
+out vec4 FragColor;
+
+void main() {
+    FragColor = vColor;
+}
+)";
+
+static const shader_source DIRECT_VS = { "direct.vert", vertex_shader_source };
+static const shader_source DIRECT_FS = { "direct.frag", fragment_shader_source };
+static const shader_source INSTANCED_VS = { "instanced.vert", instanced_vertex_shader_source };
+static const shader_source BAKED_VS = { "baked.vert", baked_vertex_shader_source };
+static const shader_source PROCEDURAL_VS = { "procedural.vert", procedural_vertex_shader_source };
+static const shader_source VERTEX_COLOR_FS = { "vertex_color.frag", instanced_fragment_shader_source };
+
+// ---------------- frustum_t ----------------
+frustum_t frustum_t::from_matrix(const glm::mat4& m) {
+    // rows of the (column-major) matrix
+    glm::vec4 r0(m[0][0], m[1][0], m[2][0], m[3][0]);
+    glm::vec4 r1(m[0][1], m[1][1], m[2][1], m[3][1]);
+    glm::vec4 r2(m[0][2], m[1][2], m[2][2], m[3][2]);
+    glm::vec4 r3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+    frustum_t f;
+    f.planes[0] = r3 + r0;  // left
+    f.planes[1] = r3 - r0;  // right
+    f.planes[2] = r3 + r1;  // bottom
+    f.planes[3] = r3 - r1;  // top
+    f.planes[4] = r3 + r2;  // near
+    f.planes[5] = r3 - r2;  // far
+    return f;
+}
+
+int frustum_t::classify(const glm::vec3& box_min, const glm::vec3& box_max) const {
+    if (box_min.x > box_max.x) return OUTSIDE;  // empty box
+
+    int result = INSIDE;
+    for (int i = 0; i < 6; i++) {
+        const glm::vec4& p = planes[i];
+        // corner furthest along the plane normal, and the one opposite it
+        glm::vec3 pos(p.x >= 0 ? box_max.x : box_min.x,
+                      p.y >= 0 ? box_max.y : box_min.y,
+                      p.z >= 0 ? box_max.z : box_min.z);
+        glm::vec3 neg(p.x >= 0 ? box_min.x : box_max.x,
+                      p.y >= 0 ? box_min.y : box_max.y,
+                      p.z >= 0 ? box_min.z : box_max.z);
+        if (p.x*pos.x + p.y*pos.y + p.z*pos.z + p.w < 0) return OUTSIDE;
+        if (p.x*neg.x + p.y*neg.y + p.z*neg.z + p.w < 0) result = INTERSECTS;
+    }
+    return result;
+}
+
+// ---------------- renderer_t ----------------
+renderer_t::renderer_t()
+    : direct_program(0), uniform_mvp(-1), uniform_color(-1),
+      instanced_program(0), uniform_view_proj(-1),
+      baked_program(0), uniform_baked_mvp(-1),
+      procedural_program(0), uniform_procedural_view_proj(-1),
+      uniform_procedural_type(-1), uniform_procedural_slices(-1), uniform_procedural_stacks(-1),
+      use_instancing(true), use_indirect(true), use_culling(true), use_lod(false), use_procedural(false),
+      viewport_height(600.0f), profiler(nullptr), instance_vbo(0), procedural_vao(0) {
+}
+
+renderer_t::~renderer_t() {
+    shutdown();
+}
+
+bool renderer_t::init() {
+    shader_manager_t& shaders = shader_manager_t::instance();
+    if (!direct_program) {
+        direct_program = shaders.program(DIRECT_VS, DIRECT_FS);
+        if (!direct_program) return false;
+        uniform_mvp = glGetUniformLocation(direct_program, "uMVP");
+        uniform_color = glGetUniformLocation(direct_program, "uColor");
+    }
+
+    // instancing is optional; draw() falls back to the per-node path
+    if (!instanced_program) {
+        instanced_program = shaders.program(INSTANCED_VS, VERTEX_COLOR_FS);
+        if (instanced_program) uniform_view_proj = glGetUniformLocation(instanced_program, "uViewProj");
+        else std::cout << "Instanced shader unavailable, using per-node drawing\n";
+    }
+
+    // without it frozen subtrees draw node by node (see draw())
+    if (!baked_program) {
+        baked_program = shaders.program(BAKED_VS, VERTEX_COLOR_FS);
+        if (baked_program) uniform_baked_mvp = glGetUniformLocation(baked_program, "uMVP");
+    }
+
+    if (!instance_vbo) glGenBuffers(1, &instance_vbo);
+
+    if (!procedural_program) {
+        procedural_program = shaders.program(PROCEDURAL_VS, VERTEX_COLOR_FS);
+        if (procedural_program) {
+            uniform_procedural_view_proj = glGetUniformLocation(procedural_program, "uViewProj");
+            uniform_procedural_type = glGetUniformLocation(procedural_program, "uType");
+            uniform_procedural_slices = glGetUniformLocation(procedural_program, "uSlices");
+            uniform_procedural_stacks = glGetUniformLocation(procedural_program, "uStacks");
+        }
+    }
+    if (procedural_program && instance_vbo && !procedural_vao) {
+        // same instance layout as shape_t::attach_instance_buffer()
+        const GLsizei stride = sizeof(instance_data);
+        glGenVertexArrays(1, &procedural_vao);
+        glBindVertexArray(procedural_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+        for (GLuint i = 0; i < 5; i++) {
+            glVertexAttribPointer(1 + i, 4, GL_FLOAT, GL_FALSE, stride, (void*)(i * sizeof(glm::vec4)));
+            glEnableVertexAttribArray(1 + i);
+            glVertexAttribDivisor(1 + i, 1);
+        }
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // multi-draw indirect reuses the instanced program's attribute layout
+    if (instanced_program && indirect.init())
+        std::cout << "Multi-draw indirect available" << (indirect.persistent() ? " (persistent mapping)" : "") << "\n";
+    return instance_vbo != 0;
+}
+
+void renderer_t::shutdown() {
+    indirect.shutdown();
+    if (procedural_vao) {
+        glDeleteVertexArrays(1, &procedural_vao);
+        procedural_vao = 0;
+    }
+    if (instance_vbo) {
+        glDeleteBuffers(1, &instance_vbo);
+        instance_vbo = 0;
+    }
+    if (direct_program) {
+        glDeleteProgram(direct_program);
+        direct_program = 0;
+    }
+    if (instanced_program) {
+        glDeleteProgram(instanced_program);
+        instanced_program = 0;
+    }
+    if (baked_program) {
+        glDeleteProgram(baked_program);
+        baked_program = 0;
+    }
+    if (procedural_program) {
+        glDeleteProgram(procedural_program);
+        procedural_program = 0;
+    }
+}
+
+void renderer_t::draw(model_t* model, const glm::mat4& view, const glm::mat4& proj) {
+    if (!model || !model->root) return;
+
+    glm::mat4 view_proj = proj * view;
+    if (profiler) profiler->gpu_begin();
+
+    {
+        scoped_timer t(profiler, PROFILE_UPDATE);
+        model->sync_frozen();
+        model->update_world_matrices();
+    }
+    bool draw_frozen = baked_program && !model->frozen_subtrees().empty();
+
+    {
+        scoped_timer t(profiler, PROFILE_TRAVERSE);
+        // without culling, walk the model's own flat array instead of copying it
+        const std::vector<model_node*>* drawn = &nodes;
+        nodes.clear();
+        if (use_culling) collect_visible(model->root, frustum_t::from_matrix(view_proj), false);
+        else drawn = &model->flat_nodes();
+
+        // projected pixels per world unit at view depth 1
+        float pixel_scale = proj[1][1] * 0.5f * viewport_height;
+        bool procedural = use_procedural && procedural_vao;
+        items.clear();
+        for (auto n : *drawn) {
+            if (!n->shape || (draw_frozen && n->frozen)) continue;
+            draw_item it;
+            it.node = n;
+            if (procedural) {
+                // the level alone is enough, so LOD never builds a mesh here
+                it.shape = n->shape;
+                it.level = use_lod ? select_lod_level(n, view_proj, pixel_scale) : n->shape->level;
+            } else {
+                it.shape = use_lod ? select_lod(model, n, view_proj, pixel_scale) : n->shape;
+                it.level = it.shape->level;
+            }
+            items.push_back(it);
+        }
+    }
+
+    {
+        scoped_timer t(profiler, PROFILE_SUBMIT);
+        if (use_procedural && procedural_vao) draw_procedural(view_proj);
+        else if (use_instancing && instanced_program && instance_vbo) draw_instanced(view_proj);
+        else if (direct_program) draw_direct(view_proj);
+        if (draw_frozen) draw_baked(model, view_proj);
+    }
+
+    if (profiler) profiler->gpu_end();
+}
+
+// Preorder walk that drops subtrees outside the frustum and stops testing
+// once a subtree is known to be fully inside.
+void renderer_t::collect_visible(model_node* n, const frustum_t& frustum, bool inside) {
+    if (!inside) {
+        int c = frustum.classify(n->subtree_min, n->subtree_max);
+        if (c == frustum_t::OUTSIDE) return;
+        inside = (c == frustum_t::INSIDE);
+    }
+    if (n->shape && (inside || frustum.classify(n->bounds_min, n->bounds_max) != frustum_t::OUTSIDE)) {
+        nodes.push_back(n);
+    }
+    for (model_node* c = n->first_child; c; c = c->next_sibling) collect_visible(c, frustum, inside);
+}
+
+// Screen-space diameter (pixels) at which LOD level i switches to i+1.
+// A switch needs the size to clear the boundary by LOD_HYSTERESIS so that
+// nodes sitting on a boundary don't flicker between levels.
+static const float LOD_THRESHOLDS[MAX_TESS_LEVEL] = { 40.0f, 120.0f, 300.0f, 600.0f };
+static const float LOD_HYSTERESIS = 0.15f;
+
+unsigned int renderer_t::select_lod_level(model_node* n, const glm::mat4& view_proj, float pixel_scale) {
+    if (n->shape->shapetype == BOX_SHAPE) return 0;     // boxes have a single level
+
+    glm::vec3 center = 0.5f * (n->bounds_min + n->bounds_max);
+    float radius = 0.5f * glm::length(n->bounds_max - n->bounds_min);
+    // clip-space w of the center is its view depth for a perspective projection
+    float depth = view_proj[0][3]*center.x + view_proj[1][3]*center.y + view_proj[2][3]*center.z + view_proj[3][3];
+    float pixels = depth > 1e-4f ? 2.0f * radius * pixel_scale / depth : LOD_THRESHOLDS[MAX_TESS_LEVEL-1] * 2.0f;
+
+    unsigned int level = n->lod_level > MAX_TESS_LEVEL ? MAX_TESS_LEVEL : n->lod_level;
+    while (level < MAX_TESS_LEVEL && pixels > LOD_THRESHOLDS[level] * (1.0f + LOD_HYSTERESIS)) level++;
+    while (level > 0 && pixels < LOD_THRESHOLDS[level-1] * (1.0f - LOD_HYSTERESIS)) level--;
+    n->lod_level = level;
+    return level;
+}
+
+const shape_t* renderer_t::select_lod(model_t* model, model_node* n, const glm::mat4& view_proj, float pixel_scale) {
+    unsigned int level = select_lod_level(n, view_proj, pixel_scale);
+    if (level == n->shape->level) return n->shape;
+    const shape_t* s = model->get_shape(n->shape->shapetype, level);
+    return s ? s : n->shape;
+}
+
+static uint32_t pack_color(const glm::vec4& c) {
+    uint32_t packed = 0;
+    for (int i = 0; i < 4; i++) {
+        float v = c[i] < 0.0f ? 0.0f : (c[i] > 1.0f ? 1.0f : c[i]);
+        packed = (packed << 8) | (uint32_t)(v * 255.0f + 0.5f);
+    }
+    return packed;
+}
+
+// Key layout: program (8 bits) | VAO (24 bits) | RGBA8 color (32 bits).
+// GL names are small integers, so truncating them keeps equal state
+// adjacent; a rare collision only costs a redundant bind.
+void renderer_t::build_queue(GLuint program) {
+    queue.clear();
+    queue.reserve(items.size());
+    uint64_t program_bits = (uint64_t)(program & 0xFF) << 56;
+    for (size_t i = 0; i < items.size(); i++) {
+        const draw_item& it = items[i];
+        if (!it.shape->buffers_initialized) continue;
+        queue_entry e;
+        e.key = program_bits | (uint64_t)(it.shape->VAO & 0xFFFFFF) << 32 | pack_color(it.node->color);
+        e.item = (uint32_t)i;
+        queue.push_back(e);
+    }
+    // item index breaks ties so the order is stable frame to frame
+    std::sort(queue.begin(), queue.end(), [](const queue_entry& a, const queue_entry& b) {
+        return a.key != b.key ? a.key < b.key : a.item < b.item;
+    });
+}
+
+// One draw per frozen subtree, culled by the root's subtree bounds
+void renderer_t::draw_baked(model_t* model, const glm::mat4& view_proj) {
+    frustum_t frustum = frustum_t::from_matrix(view_proj);
+    glUseProgram(baked_program);
+    if (profiler) profiler->count_state_change();
+    for (const frozen_subtree* f : model->frozen_subtrees()) {
+        const model_node* r = f->root;
+        if (use_culling && frustum.classify(r->subtree_min, r->subtree_max) == frustum_t::OUTSIDE) continue;
+        glm::mat4 mvp = view_proj * r->get_world_matrix();
+        glUniformMatrix4fv(uniform_baked_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
+        glBindVertexArray(f->vao);
+        glDrawElements(GL_TRIANGLES, f->index_count, GL_UNSIGNED_INT, (void*)0);
+        if (profiler) profiler->count_draw(f->index_count / 3);
+    }
+    glBindVertexArray(0);
+}
+
+void renderer_t::draw_direct(const glm::mat4& view_proj) {
+    build_queue(direct_program);
+
+    glUseProgram(direct_program);
+    if (profiler) profiler->count_state_change();
+
+    // only issue binds and uniforms that differ from the last draw's
+    GLuint bound_vao = 0;
+    bool have_color = false;
+    glm::vec4 color;
+    for (const auto& e : queue) {
+        const draw_item& it = items[e.item];
+        const shape_t* s = it.shape;
+        if (s->VAO != bound_vao) {
+            glBindVertexArray(s->VAO);
+            bound_vao = s->VAO;
+            if (profiler) profiler->count_state_change();
+        }
+        if (!have_color || it.node->color != color) {
+            color = it.node->color;
+            have_color = true;
+            glUniform4fv(uniform_color, 1, glm::value_ptr(color));
+            if (profiler) profiler->count_state_change();
+        }
+
+        glm::mat4 mvp = view_proj * it.node->get_world_matrix();
+        glUniformMatrix4fv(uniform_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
+        glDrawElements(GL_TRIANGLES, s->index_count, s->index_type, (void*)0);
+        if (profiler) profiler->count_draw(s->index_count / 3);
+    }
+    glBindVertexArray(0);
+}
+
+shape_batch& renderer_t::batch_for(const shape_t* shape) {
+    for (auto& b : batches) {
+        if (b.shape == shape) return b;
+    }
+    batches.push_back(shape_batch());
+    batches.back().shape = shape;
+    return batches.back();
+}
+
+// Groups the visible items by shared mesh; batch storage is kept between frames
+void renderer_t::build_batches() {
+    for (auto& b : batches) b.instances.clear();
+    for (const auto& it : items) {
+        instance_data d;
+        d.model = it.node->get_world_matrix();
+        d.color = it.node->color;
+        batch_for(it.shape).instances.push_back(d);
+    }
+}
+
+// Drops batches for meshes that are no longer referenced (e.g. after a reload)
+void renderer_t::forget_meshes() {
+    batches.clear();
+    indirect.clear_meshes();
+}
+
+void renderer_t::prune_batches() {
+    for (size_t i = 0; i < batches.size(); ) {
+        if (batches[i].instances.empty()) {
+            std::swap(batches[i], batches.back());
+            batches.pop_back();
+        } else {
+            ++i;
+        }
+    }
+}
+
+void renderer_t::draw_instanced(const glm::mat4& view_proj) {
+    build_batches();
+
+    glUseProgram(instanced_program);
+    glUniformMatrix4fv(uniform_view_proj, 1, GL_FALSE, glm::value_ptr(view_proj));
+    if (profiler) profiler->count_state_change();
+
+    if (use_indirect && indirect.available() && indirect.draw(batches, profiler)) {
+        prune_batches();
+        return;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+    if (profiler) profiler->count_state_change();
+    for (auto& b : batches) {
+        if (b.instances.empty()) continue;
+        // respecifying the store each batch lets the driver orphan the old one
+        glBufferData(GL_ARRAY_BUFFER, b.instances.size() * sizeof(instance_data),
+                     b.instances.data(), GL_STREAM_DRAW);
+        b.shape->attach_instance_buffer(instance_vbo);
+        b.shape->draw_instanced((GLsizei)b.instances.size());
+        if (profiler) {
+            profiler->count_state_change(2);  // upload + VAO bind
+            profiler->count_draw((unsigned long)(b.shape->index_count / 3) * b.instances.size());
+        }
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    prune_batches();
+}
+
+// Triangles the procedural shader draws for a type and level, the same
+// as the generated mesh; slices and stacks as the uniforms take them
+static unsigned int procedural_triangles(ShapeType type, unsigned int level, GLint& slices, GLint& stacks) {
+    stacks = 0;
+    switch (type) {
+    case SPHERE_SHAPE:
+        slices = sphere_t::slices(level);
+        stacks = sphere_t::stacks(level);
+        return sphere_t::index_count(level) / 3;
+    case CYLINDER_SHAPE:
+        slices = cylinder_t::slices(level);
+        return cylinder_t::index_count(level) / 3;
+    case CONE_SHAPE:
+        slices = cone_t::slices(level);
+        return cone_t::index_count(level) / 3;
+    default:
+        slices = 0;
+        return box_t::index_count(0) / 3;
+    }
+}
+
+// One instanced glDrawArrays per (type, level) from an empty VAO: nothing
+// is fetched per vertex, and levels that no node's mesh uses cost nothing
+void renderer_t::draw_procedural(const glm::mat4& view_proj) {
+    for (const auto& it : items) {
+        instance_data d;
+        d.model = it.node->get_world_matrix();
+        d.color = it.node->color;
+        procedural_batches[it.shape->shapetype][it.level].push_back(d);
+    }
+
+    glUseProgram(procedural_program);
+    glUniformMatrix4fv(uniform_procedural_view_proj, 1, GL_FALSE, glm::value_ptr(view_proj));
+    glBindVertexArray(procedural_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+    if (profiler) profiler->count_state_change(3);
+    for (int type = 0; type < NUM_SHAPE_TYPES; type++) {
+        for (unsigned int level = 0; level <= MAX_TESS_LEVEL; level++) {
+            std::vector<instance_data>& instances = procedural_batches[type][level];
+            if (instances.empty()) continue;
+            GLint slices, stacks;
+            unsigned int triangles = procedural_triangles((ShapeType)type, level, slices, stacks);
+            glUniform1i(uniform_procedural_type, type);
+            glUniform1i(uniform_procedural_slices, slices);
+            glUniform1i(uniform_procedural_stacks, stacks);
+            glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(instance_data),
+                         instances.data(), GL_STREAM_DRAW);
+            glDrawArraysInstanced(GL_TRIANGLES, 0, 3 * triangles, (GLsizei)instances.size());
+            if (profiler) {
+                profiler->count_state_change(4);    // three uniforms + upload
+                profiler->count_draw((unsigned long)triangles * instances.size());
+            }
+            instances.clear();
+        }
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+// ---------------- indirect_renderer_t ----------------
+indirect_renderer_t::indirect_renderer_t()
+    : supported(false), persistent_mapping(false), vao(0),
+      vertex_buffer(0), index_buffer(0), geometry_format(VERTEX_FLOAT3), vertex_capacity(0), index_capacity(0),
+      vertices_used(0), indices_used(0),
+      instance_buffer(0), command_buffer(0), instance_capacity(0), command_capacity(0),
+      instance_map(nullptr), command_map(nullptr), region(0) {
+    for (unsigned int i = 0; i < REGIONS; i++) fences[i] = 0;
+}
+
+indirect_renderer_t::~indirect_renderer_t() {
+    shutdown();
+}
+
+bool indirect_renderer_t::init() {
+    if (vao) return supported;
+    // baseInstance in the command needs 4.2; the multi-draw itself 4.3
+    supported = GLEW_VERSION_4_3 != 0;
+    if (!supported) return false;
+    persistent_mapping = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+
+    glGenVertexArrays(1, &vao);
+    create_geometry_buffers(64 * 1024, 256 * 1024, VERTEX_FLOAT3);
+    if (!create_stream_buffers(4096, 64)) {
+        shutdown();
+        return false;
+    }
+    return true;
+}
+
+void indirect_renderer_t::shutdown() {
+    destroy_stream_buffers();
+    if (vertex_buffer) glDeleteBuffers(1, &vertex_buffer);
+    if (index_buffer) glDeleteBuffers(1, &index_buffer);
+    if (vao) glDeleteVertexArrays(1, &vao);
+    vertex_buffer = index_buffer = vao = 0;
+    vertex_capacity = index_capacity = vertices_used = indices_used = 0;
+    packed.clear();
+    supported = false;
+}
+
+// Fresh, empty geometry buffers; every mesh has to be packed again
+void indirect_renderer_t::create_geometry_buffers(size_t vertices, size_t indices, VertexFormat format) {
+    if (vertex_buffer) glDeleteBuffers(1, &vertex_buffer);
+    if (index_buffer) glDeleteBuffers(1, &index_buffer);
+    glGenBuffers(1, &vertex_buffer);
+    glGenBuffers(1, &index_buffer);
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices * vertex_format_stride(format), nullptr, GL_STATIC_DRAW);
+    set_position_attribute(format);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    geometry_format = format;
+    vertex_capacity = vertices;
+    index_capacity = indices;
+    vertices_used = indices_used = 0;
+    packed.clear();
+}
+
+bool indirect_renderer_t::create_stream_buffers(size_t instances, size_t cmds) {
+    destroy_stream_buffers();
+    GLsizeiptr instance_bytes = (GLsizeiptr)(REGIONS * instances * sizeof(instance_data));
+    GLsizeiptr command_bytes = (GLsizeiptr)(REGIONS * cmds * sizeof(draw_command));
+
+    glGenBuffers(1, &instance_buffer);
+    glGenBuffers(1, &command_buffer);
+    if (persistent_mapping) {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+        glBufferStorage(GL_ARRAY_BUFFER, instance_bytes, nullptr, flags);
+        instance_map = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, instance_bytes, flags);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+        glBufferStorage(GL_DRAW_INDIRECT_BUFFER, command_bytes, nullptr, flags);
+        command_map = (char*)glMapBufferRange(GL_DRAW_INDIRECT_BUFFER, 0, command_bytes, flags);
+        if (!instance_map || !command_map) {
+            // fall back to mapping each region per frame
+            persistent_mapping = false;
+            return create_stream_buffers(instances, cmds);
+        }
+    } else {
+        glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+        glBufferData(GL_ARRAY_BUFFER, instance_bytes, nullptr, GL_STREAM_DRAW);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, command_bytes, nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    // instance attributes read from the start of the ring; base_instance
+    // selects the region and the batch within it
+    const GLsizei stride = sizeof(instance_data);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+    for (GLuint i = 0; i < 5; i++) {
+        glVertexAttribPointer(1 + i, 4, GL_FLOAT, GL_FALSE, stride, (void*)(i * sizeof(glm::vec4)));
+        glEnableVertexAttribArray(1 + i);
+        glVertexAttribDivisor(1 + i, 1);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    instance_capacity = instances;
+    command_capacity = cmds;
+    region = 0;
+    return true;
+}
+
+void indirect_renderer_t::destroy_stream_buffers() {
+    // deleting a buffer unmaps it; fences can go, the GL keeps the storage
+    // alive until pending draws are done
+    for (unsigned int i = 0; i < REGIONS; i++) {
+        if (fences[i]) glDeleteSync(fences[i]);
+        fences[i] = 0;
+    }
+    if (instance_buffer) glDeleteBuffers(1, &instance_buffer);
+    if (command_buffer) glDeleteBuffers(1, &command_buffer);
+    instance_buffer = command_buffer = 0;
+    instance_map = command_map = nullptr;
+    instance_capacity = command_capacity = 0;
+}
+
+void indirect_renderer_t::wait_region(unsigned int r) {
+    if (!fences[r]) return;
+    GLenum status = glClientWaitSync(fences[r], 0, 0);
+    while (status == GL_TIMEOUT_EXPIRED) {
+        status = glClientWaitSync(fences[r], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);  // 1 ms
+    }
+    glDeleteSync(fences[r]);
+    fences[r] = 0;
+}
+
+const indirect_renderer_t::packed_mesh* indirect_renderer_t::find_packed(const shape_t* shape) const {
+    for (const auto& p : packed) {
+        if (p.mesh_id == shape->mesh_id) return &p;
+    }
+    return nullptr;
+}
+
+// Appends a mesh to the shared buffers, re-encoded in geometry_format;
+// false if it doesn't fit
+bool indirect_renderer_t::pack(const shape_t* shape) {
+    if (!vertex_format_fits(geometry_format, shape->bounds_min, shape->bounds_max)) return false;
+    std::vector<glm::vec3> positions;
+    std::vector<GLuint> indices;
+    if (!shape->read_back(positions, indices)) return false;
+    if (vertices_used + positions.size() > vertex_capacity || indices_used + indices.size() > index_capacity)
+        return false;
+
+    size_t stride = vertex_format_stride(geometry_format);
+    std::vector<char> encoded(positions.size() * stride);
+    encode_positions(geometry_format, positions.data(), positions.size(), encoded.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, vertex_buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, vertices_used * stride, encoded.size(), encoded.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, index_buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, indices_used * sizeof(GLuint),
+                    indices.size() * sizeof(GLuint), indices.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    packed_mesh p;
+    p.mesh_id = shape->mesh_id;
+    p.first_index = (GLuint)indices_used;
+    p.base_vertex = (GLint)vertices_used;
+    p.index_count = (GLuint)indices.size();
+    packed.push_back(p);
+    vertices_used += positions.size();
+    indices_used += indices.size();
+    return true;
+}
+
+void indirect_renderer_t::clear_meshes() {
+    packed.clear();
+    vertices_used = indices_used = 0;
+}
+
+// Rebuilds the shared buffers around the meshes in use this frame, which
+// also drops meshes the cache has since freed. Empty batches are skipped:
+// their shape may be one of those.
+bool indirect_renderer_t::repack(const std::vector<shape_batch>& batches, VertexFormat format) {
+    size_t vertices = 0, indices = 0;
+    for (const auto& b : batches) {
+        if (b.instances.empty()) continue;
+        vertices += b.shape->vertex_count;
+        indices += b.shape->index_count;
+    }
+    create_geometry_buffers(std::max(2 * vertices, vertex_capacity), std::max(2 * indices, index_capacity), format);
+    for (const auto& b : batches) {
+        if (!b.instances.empty() && !find_packed(b.shape) && !pack(b.shape)) return false;
+    }
+    return true;
+}
+
+bool indirect_renderer_t::draw(const std::vector<shape_batch>& batches, profiler_t* profiler) {
+    if (!supported) return false;
+
+    // one shared format: the meshes' own if they agree, else float
+    size_t instances = 0, draws = 0;
+    VertexFormat format = NUM_VERTEX_FORMATS;
+    for (const auto& b : batches) {
+        if (b.instances.empty()) continue;
+        instances += b.instances.size();
+        draws++;
+        if (format == NUM_VERTEX_FORMATS) format = b.shape->vertex_format;
+        else if (format != b.shape->vertex_format) format = VERTEX_FLOAT3;
+    }
+    if (!draws) return true;
+
+    bool missing = format != geometry_format;
+    for (const auto& b : batches) {
+        if (missing) break;
+        if (!b.instances.empty() && !find_packed(b.shape) && !pack(b.shape)) missing = true;
+    }
+    if (missing && !repack(batches, format)) return false;
+
+    if (instances > instance_capacity || draws > command_capacity) {
+        if (!create_stream_buffers(std::max(instances, 2 * instance_capacity), std::max(draws, 2 * command_capacity)))
+            return false;
+    }
+
+    // the region written REGIONS frames ago must be done on the GPU
+    wait_region(region);
+    size_t instance_offset = region * instance_capacity * sizeof(instance_data);
+    size_t command_offset = region * command_capacity * sizeof(draw_command);
+
+    char* instance_dst = instance_map ? instance_map + instance_offset : nullptr;
+    if (!instance_dst) {
+        glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+        instance_dst = (char*)glMapBufferRange(GL_ARRAY_BUFFER, instance_offset, instances * sizeof(instance_data),
+                                               GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        if (!instance_dst) return false;
+    }
+
+    commands.clear();
+    unsigned long triangles = 0;
+    GLuint base_instance = (GLuint)(region * instance_capacity);
+    for (const auto& b : batches) {
+        if (b.instances.empty()) continue;
+        const packed_mesh* p = find_packed(b.shape);
+        memcpy(instance_dst, b.instances.data(), b.instances.size() * sizeof(instance_data));
+        instance_dst += b.instances.size() * sizeof(instance_data);
+
+        draw_command c;
+        c.count = p->index_count;
+        c.instance_count = (GLuint)b.instances.size();
+        c.first_index = p->first_index;
+        c.base_vertex = p->base_vertex;
+        c.base_instance = base_instance;
+        commands.push_back(c);
+        base_instance += c.instance_count;
+        triangles += (unsigned long)(p->index_count / 3) * b.instances.size();
+    }
+    if (!instance_map) {
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+    if (command_map) memcpy(command_map + command_offset, commands.data(), commands.size() * sizeof(draw_command));
+    else glBufferSubData(GL_DRAW_INDIRECT_BUFFER, command_offset, commands.size() * sizeof(draw_command), commands.data());
+
+    glBindVertexArray(vao);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)command_offset, (GLsizei)commands.size(), 0);
+    glBindVertexArray(0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    if (profiler) {
+        profiler->count_draw(triangles);
+        profiler->count_state_change(2);  // VAO + indirect buffer
+    }
+
+    fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    region = (region + 1) % REGIONS;
+    return true;
+}
@@ -0,0 +1,180 @@
+#ifndef RENDERER_HPP
+#define RENDERER_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include <GL/glew.h>
+#include "model.hpp"
+#include "profiler.hpp"
+
+// Per-instance data streamed to the instanced shader (locations 1-5)
+struct instance_data {
+    glm::mat4 model;
+    glm::vec4 color;
+};
+
+// All visible instances of one shared mesh
+struct shape_batch {
+    const shape_t* shape;
+    std::vector<instance_data> instances;
+};
+
+// Six clip planes (ax + by + cz + d >= 0 inside) taken from a view-projection
+struct frustum_t {
+    glm::vec4 planes[6];
+
+    static frustum_t from_matrix(const glm::mat4& view_proj);
+
+    enum { OUTSIDE = 0, INTERSECTS = 1, INSIDE = 2 };
+    int classify(const glm::vec3& box_min, const glm::vec3& box_max) const;
+};
+
+// Submits a whole frame's batches with one glMultiDrawElementsIndirect.
+// Meshes are packed into shared vertex/index buffers. Instance data and
+// draw commands go into ring buffers split into REGIONS parts, persistently
+// mapped where GL 4.4 buffer storage exists; a fence per part keeps the
+// CPU from overwriting data the GPU hasn't consumed yet.
+class indirect_renderer_t {
+public:
+    static const unsigned int REGIONS = 3;
+
+    indirect_renderer_t();
+    ~indirect_renderer_t();
+
+    bool init();        // false unless the context is GL 4.3+
+    void shutdown();
+    bool available() const { return supported; }
+    bool persistent() const { return persistent_mapping; }
+
+    // Draws with the program already bound (the instanced program: its
+    // attributes 1-5 come from the instance ring). False if it couldn't.
+    bool draw(const std::vector<shape_batch>& batches, profiler_t* profiler);
+    // forgets the packed meshes; the next draw() packs what it needs again
+    void clear_meshes();
+
+private:
+    // DrawElementsIndirectCommand as laid out by GL
+    struct draw_command {
+        GLuint count;
+        GLuint instance_count;
+        GLuint first_index;
+        GLint base_vertex;
+        GLuint base_instance;
+    };
+
+    struct packed_mesh {
+        uint32_t mesh_id;
+        GLuint first_index;
+        GLint base_vertex;
+        GLuint index_count;
+    };
+
+    bool supported;
+    bool persistent_mapping;
+
+    GLuint vao;
+    GLuint vertex_buffer, index_buffer;     // packed meshes, GL_UNSIGNED_INT indices
+    VertexFormat geometry_format;           // of vertex_buffer
+    size_t vertex_capacity, index_capacity;
+    size_t vertices_used, indices_used;
+    std::vector<packed_mesh> packed;
+
+    GLuint instance_buffer, command_buffer; // REGIONS * capacity each
+    size_t instance_capacity, command_capacity;     // per region
+    char* instance_map;                     // persistent mappings, else null
+    char* command_map;
+    GLsync fences[REGIONS];
+    unsigned int region;
+
+    std::vector<draw_command> commands;     // reused across frames
+
+    const packed_mesh* find_packed(const shape_t* shape) const;
+    bool pack(const shape_t* shape);
+    bool repack(const std::vector<shape_batch>& batches, VertexFormat format);
+    void create_geometry_buffers(size_t vertices, size_t indices, VertexFormat format);
+    bool create_stream_buffers(size_t instances, size_t commands);
+    void destroy_stream_buffers();
+    void wait_region(unsigned int r);
+};
+
+// Submits a model either node by node or grouped by shape with instancing
+class renderer_t {
+public:
+    // per-node program: uMVP + uColor uniforms
+    GLuint direct_program;
+    GLint uniform_mvp;
+    GLint uniform_color;
+
+    // instanced program: uViewProj uniform, model matrix + color per instance
+    GLuint instanced_program;
+    GLint uniform_view_proj;
+
+    // frozen subtrees: uMVP uniform, position + RGBA8 color per vertex
+    GLuint baked_program;
+    GLint uniform_baked_mvp;
+
+    // procedural program: instanced like the above, but positions come
+    // from gl_VertexID and the uType/uSlices/uStacks uniforms
+    GLuint procedural_program;
+    GLint uniform_procedural_view_proj;
+    GLint uniform_procedural_type, uniform_procedural_slices, uniform_procedural_stacks;
+
+    bool use_instancing;
+    bool use_indirect;          // one multi-draw per frame when GL 4.3 is there
+    bool use_culling;           // skip subtrees whose bounds leave the frustum
+    bool use_lod;               // pick tessellation level from screen size
+    bool use_procedural;        // build primitives in the vertex shader, no vertex buffers
+    float viewport_height;      // pixels, for LOD screen-size estimates
+    profiler_t* profiler;       // optional timings and draw counters
+
+    renderer_t();
+    ~renderer_t();
+
+    bool init();        // builds programs and buffers; needs a current GL context
+    void shutdown();
+
+    void draw(model_t* model, const glm::mat4& view, const glm::mat4& proj);
+    // Drops the mesh pointers kept between frames (batches, packed indirect
+    // meshes). Call when a drawn model is deleted, since the cache may free
+    // its meshes and a new one can reuse their addresses.
+    void forget_meshes();
+    bool indirect_available() const { return indirect.available(); }
+
+private:
+    struct draw_item {
+        model_node* node;
+        const shape_t* shape;   // node's shape or the LOD replacement
+        unsigned int level;     // procedural mode: the level to draw at
+    };
+
+    // Direct-path submission order. Keys sort by program, then VAO, then
+    // color (RGBA8), so each state change happens once per run of equal
+    // keys instead of once per node.
+    struct queue_entry {
+        uint64_t key;
+        uint32_t item;      // index into items
+    };
+
+    GLuint instance_vbo;
+    indirect_renderer_t indirect;
+    std::vector<model_node*> nodes;     // reused across frames
+    std::vector<draw_item> items;       // reused across frames
+    std::vector<shape_batch> batches;   // reused across frames
+    std::vector<queue_entry> queue;     // reused across frames
+    GLuint procedural_vao;              // no vertex attributes, only the instance stream
+    std::vector<instance_data> procedural_batches[NUM_SHAPE_TYPES][MAX_TESS_LEVEL + 1];
+
+    void draw_direct(const glm::mat4& view_proj);
+    void build_queue(GLuint program);
+    void draw_instanced(const glm::mat4& view_proj);
+    void draw_baked(model_t* model, const glm::mat4& view_proj);
+    void draw_procedural(const glm::mat4& view_proj);
+    void build_batches();
+    void prune_batches();
+    shape_batch& batch_for(const shape_t* shape);
+    void collect_visible(model_node* n, const frustum_t& frustum, bool inside);
+    unsigned int select_lod_level(model_node* n, const glm::mat4& view_proj, float pixel_scale);
+    const shape_t* select_lod(model_t* model, model_node* n, const glm::mat4& view_proj, float pixel_scale);
+};
+
+#endif // RENDERER_HPP
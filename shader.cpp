@@ -0,0 +1,211 @@
+#include "shader.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <sys/stat.h>
+
+static const uint32_t CACHE_VERSION = 1;
+
+// Cache file layout: this header, then length bytes of program binary
+struct program_binary_header {
+    char magic[4];          // "MSPB"
+    uint32_t version;
+    uint64_t key;           // sources + driver, see program()
+    uint32_t format;        // binaryFormat from glGetProgramBinary
+    uint32_t length;
+};
+
+// 64-bit FNV-1a
+static uint64_t hash_bytes(uint64_t h, const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64_t hash_string(uint64_t h, const std::string& s) {
+    return hash_bytes(h, s.c_str(), s.size() + 1);     // the terminator separates fields
+}
+
+static const uint64_t HASH_SEED = 14695981039346656037ull;
+
+static GLuint compile_shader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint success;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        char info_log[512];
+        glGetShaderInfoLog(shader, 512, NULL, info_log);
+        std::cout << "Shader compilation failed: " << info_log << std::endl;
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// Links a program from vertex + fragment sources, 0 on failure. With
+// retrievable set the driver keeps the binary around for glGetProgramBinary.
+static GLuint link_program(const char* vs_source, const char* fs_source, bool retrievable) {
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vs_source);
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fs_source);
+
+    if (!vertex_shader || !fragment_shader) {
+        if (vertex_shader) glDeleteShader(vertex_shader);
+        if (fragment_shader) glDeleteShader(fragment_shader);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    if (retrievable) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+    glDetachShader(program, vertex_shader);
+    glDetachShader(program, fragment_shader);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+
+    GLint success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        char info_log[512];
+        glGetProgramInfoLog(program, 512, NULL, info_log);
+        std::cout << "Shader program linking failed: " << info_log << std::endl;
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// ---------------- shader_manager_t ----------------
+shader_manager_t& shader_manager_t::instance() {
+    static shader_manager_t manager;
+    return manager;
+}
+
+shader_manager_t::shader_manager_t()
+    : source_dir("shaders"), cache_dir("shader_cache"), binary_support(-1), driver_hash(0),
+      hits(0), compiles(0), total_ms(0.0) {
+}
+
+std::string shader_manager_t::load_source(const shader_source& s) const {
+    if (s.file && !source_dir.empty()) {
+        std::ifstream in(source_dir + "/" + s.file, std::ios::binary);
+        if (in) {
+            std::ostringstream text;
+            text << in.rdbuf();
+            return text.str();
+        }
+    }
+    return s.fallback ? s.fallback : "";
+}
+
+// Program binaries are core in GL 4.1; a driver may still offer no formats
+bool shader_manager_t::check_binary_support() {
+    if (binary_support < 0) {
+        GLint formats = 0;
+        if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        binary_support = formats > 0 ? 1 : 0;
+
+        const GLenum names[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+        driver_hash = HASH_SEED;
+        for (int i = 0; i < 3; i++) {
+            const char* s = (const char*)glGetString(names[i]);
+            driver_hash = hash_string(driver_hash, s ? s : "");
+        }
+    }
+    return binary_support == 1;
+}
+
+GLuint shader_manager_t::program(const shader_source& vertex, const shader_source& fragment) {
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    std::string vs = load_source(vertex), fs = load_source(fragment);
+
+    bool cached = !cache_dir.empty() && check_binary_support();
+    std::string path;
+    uint64_t key = 0;
+    GLuint program = 0;
+    if (cached) {
+        key = hash_string(hash_string(hash_bytes(driver_hash, (const char*)&CACHE_VERSION, sizeof(CACHE_VERSION)), vs), fs);
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)key);
+        path = cache_dir + name;
+        program = load_binary(path, key);
+        if (program) hits++;
+    }
+    if (!program) {
+        program = link_program(vs.c_str(), fs.c_str(), cached);
+        if (program) {
+            compiles++;
+            if (cached) store_binary(path, key, program);
+        }
+    }
+
+    total_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    return program;
+}
+
+// 0 on a missing, mismatched or rejected binary; rejected ones are deleted
+GLuint shader_manager_t::load_binary(const std::string& path, uint64_t key) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return 0;
+    program_binary_header h;
+    if (!in.read((char*)&h, sizeof(h)) || memcmp(h.magic, "MSPB", 4) != 0 ||
+        h.version != CACHE_VERSION || h.key != key || h.length == 0) {
+        return 0;
+    }
+    std::vector<char> binary(h.length);
+    if (!in.read(binary.data(), binary.size())) return 0;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, h.format, binary.data(), (GLsizei)binary.size());
+    GLint success = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        // e.g. a driver update that didn't change the version string
+        glDeleteProgram(program);
+        in.close();
+        remove(path.c_str());
+        return 0;
+    }
+    return program;
+}
+
+// Written under a temporary name and renamed, so a crash mid-write leaves
+// no half-written entry behind
+void shader_manager_t::store_binary(const std::string& path, uint64_t key, GLuint program) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    GLsizei written = 0;
+    glGetProgramBinary(program, length, &written, &format, binary.data());
+    if (written <= 0) return;
+
+    mkdir(cache_dir.c_str(), 0755);     // fails harmlessly if it exists
+    program_binary_header h;
+    memcpy(h.magic, "MSPB", 4);
+    h.version = CACHE_VERSION;
+    h.key = key;
+    h.format = format;
+    h.length = (uint32_t)written;
+
+    std::string tmp = path + ".tmp";
+    std::ofstream out(tmp, std::ios::binary);
+    out.write((const char*)&h, sizeof(h));
+    out.write(binary.data(), written);
+    out.close();
+    if (!out || rename(tmp.c_str(), path.c_str()) != 0) {
+        std::cout << "Couldn't write shader cache entry " << path << "\n";
+        remove(tmp.c_str());
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef SHADER_HPP
+#define SHADER_HPP
+
+#include <string>
+#include <cstdint>
+#include <GL/glew.h>
+
+// One shader stage: a file under the shader directory, and the built-in
+// copy used when that file can't be read
+struct shader_source {
+    const char* file;
+    const char* fallback;
+};
+
+// Builds GL programs from vertex + fragment sources. Linked programs are
+// cached on disk as driver binaries (glGetProgramBinary), keyed by a hash
+// of both sources and the GL vendor/renderer/version strings, so editing
+// a shader or updating the driver just misses the cache. A miss, or a
+// binary the driver rejects, compiles from source and rewrites the entry.
+// GL thread only.
+class shader_manager_t {
+public:
+    static shader_manager_t& instance();
+
+    // where shaders/NAME.vert etc. are looked up; "shaders" by default
+    void set_source_dir(const std::string& dir) { source_dir = dir; }
+    // where binaries go; empty turns the cache off. "shader_cache" by default
+    void set_cache_dir(const std::string& dir) { cache_dir = dir; }
+
+    // A new program the caller deletes, 0 (after printing why) on failure
+    GLuint program(const shader_source& vertex, const shader_source& fragment);
+
+    // since startup
+    unsigned int cache_hits() const { return hits; }
+    unsigned int compiled() const { return compiles; }
+    double build_ms() const { return total_ms; }
+
+private:
+    std::string source_dir, cache_dir;
+    int binary_support;         // -1 until the context is checked, then 0/1
+    uint64_t driver_hash;
+    unsigned int hits, compiles;
+    double total_ms;
+
+    shader_manager_t();
+    std::string load_source(const shader_source& s) const;
+    bool check_binary_support();
+    GLuint load_binary(const std::string& path, uint64_t key);
+    void store_binary(const std::string& path, uint64_t key, GLuint program);
+};
+
+#endif // SHADER_HPP
@@ -1,6 +1,8 @@
 #version 330 core
 out vec4 FragColor;
+
 uniform vec4 uColor;
+
 void main() {
     FragColor = uColor;
 }
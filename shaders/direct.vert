@@ -1,6 +1,8 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
-uniform mat4 MVP;
+
+uniform mat4 uMVP;
+
 void main() {
-    gl_Position = MVP * vec4(aPos, 1.0);
+    gl_Position = uMVP * vec4(aPos, 1.0);
 }
@@ -0,0 +1,83 @@
+#version 330 core
+// No vertex buffer: the corner is rebuilt from gl_VertexID, in the same
+// triangle order as the meshes shape.cpp generates
+layout (location = 1) in mat4 aModel;
+layout (location = 5) in vec4 aColor;
+
+uniform mat4 uViewProj;
+uniform int uType;      // ShapeType
+uniform int uSlices;
+uniform int uStacks;    // spheres only
+
+out vec4 vColor;
+
+const float PI = 3.14159265358979;
+
+const int BOX_INDICES[36] = int[36](0,1,2, 0,2,3, 4,7,6, 4,6,5, 0,4,5, 0,5,1,
+                                    2,6,7, 2,7,3, 0,3,7, 0,7,4, 1,5,6, 1,6,2);
+
+vec3 ring_point(int j, float radius, float y) {
+    float theta = 2.0 * PI * float(j % uSlices) / float(uSlices);
+    return vec3(radius * cos(theta), y, radius * sin(theta));
+}
+
+// ring i of 0..uStacks, poles included
+vec3 sphere_point(int i, int j) {
+    float phi = PI * float(i) / float(uStacks);
+    return ring_point(j, sin(phi), cos(phi));
+}
+
+vec3 sphere_corner(int t, int c) {
+    int cap = uSlices, band = 2 * uSlices * (uStacks - 2);
+    if (t < cap) {
+        // north cap: pole, ring(1, j), ring(1, j+1)
+        return c == 0 ? vec3(0.0, 1.0, 0.0) : sphere_point(1, t + c - 1);
+    }
+    t -= cap;
+    if (t < band) {
+        int i = 2 + t / (2 * uSlices);
+        int q = t % (2 * uSlices);
+        int j = q / 2;
+        // (p1, p2, p3) then (p1, p3, p4) with p1 = ring(i-1, j),
+        // p2 = ring(i, j), p3 = ring(i, j+1), p4 = ring(i-1, j+1)
+        if (c == 0) return sphere_point(i - 1, j);
+        if ((q & 1) == 0) return sphere_point(i, j + c - 1);
+        return c == 1 ? sphere_point(i, j + 1) : sphere_point(i - 1, j + 1);
+    }
+    t -= band;
+    // south cap: ring(stacks-1, j), pole, ring(stacks-1, j+1)
+    if (c == 1) return vec3(0.0, -1.0, 0.0);
+    return sphere_point(uStacks - 1, t + c / 2);
+}
+
+vec3 cylinder_corner(int t, int c) {
+    int j = t / 4, k = t % 4;
+    vec3 b1 = ring_point(j, 0.5, -0.5), b2 = ring_point(j + 1, 0.5, -0.5);
+    vec3 t1 = ring_point(j, 0.5, 0.5), t2 = ring_point(j + 1, 0.5, 0.5);
+    if (k == 0) return c == 0 ? b1 : (c == 1 ? b2 : t2);
+    if (k == 1) return c == 0 ? b1 : (c == 1 ? t2 : t1);
+    if (k == 2) return c == 0 ? vec3(0.0, -0.5, 0.0) : (c == 1 ? b1 : b2);
+    return c == 0 ? vec3(0.0, 0.5, 0.0) : (c == 1 ? t2 : t1);
+}
+
+vec3 cone_corner(int t, int c) {
+    int j = t / 2;
+    vec3 b1 = ring_point(j, 0.5, -0.5), b2 = ring_point(j + 1, 0.5, -0.5);
+    if ((t & 1) == 0) return c == 0 ? vec3(0.0, 0.5, 0.0) : (c == 1 ? b1 : b2);
+    return c == 0 ? vec3(0.0, -0.5, 0.0) : (c == 1 ? b2 : b1);
+}
+
+vec3 box_corner(int k) {
+    return vec3(float((k + 1) >> 1 & 1), float(k >> 1 & 1), float(k >> 2)) - 0.5;
+}
+
+void main() {
+    int t = gl_VertexID / 3, c = gl_VertexID % 3;
+    vec3 p;
+    if (uType == 0) p = sphere_corner(t, c);
+    else if (uType == 1) p = cylinder_corner(t, c);
+    else if (uType == 2) p = box_corner(BOX_INDICES[gl_VertexID]);
+    else p = cone_corner(t, c);
+    gl_Position = uViewProj * aModel * vec4(p, 1.0);
+    vColor = aColor;
+}
@@ -1,243 +1,708 @@
 #include "shape.hpp"
+#include "thread_pool.hpp"
 #include <cmath>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
+// ---------------- vertex formats ----------------
+static const char* const VERTEX_FORMAT_NAMES[NUM_VERTEX_FORMATS] = { "float", "snorm16", "half" };
+
+const char* vertex_format_name(VertexFormat f) {
+    return f >= 0 && f < NUM_VERTEX_FORMATS ? VERTEX_FORMAT_NAMES[f] : "?";
+}
+
+bool parse_vertex_format(const char* name, VertexFormat& f) {
+    for (int i = 0; i < NUM_VERTEX_FORMATS; i++) {
+        if (strcmp(name, VERTEX_FORMAT_NAMES[i]) == 0) { f = (VertexFormat)i; return true; }
+    }
+    return false;
+}
+
+size_t vertex_format_stride(VertexFormat f) {
+    return f == VERTEX_FLOAT3 ? 3 * sizeof(float) : 4 * sizeof(uint16_t);
+}
+
+bool vertex_format_fits(VertexFormat f, const glm::vec3& min, const glm::vec3& max) {
+    if (f == VERTEX_FLOAT3) return true;
+    for (int k = 0; k < 3; k++) {
+        if (min[k] < -1.0f || max[k] > 1.0f) return false;
+    }
+    return true;
+}
+
+// IEEE half from float, round to nearest; inputs are within [-1, 1]
+static uint16_t float_to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000u;
+    int32_t exp = (int32_t)((x >> 23) & 0xFF) - 127 + 15;
+    uint32_t mant = x & 0x7FFFFFu;
+    if (exp >= 31) return (uint16_t)(sign | 0x7C00u);
+    if (exp <= 0) {     // half subnormal, or too small to represent
+        if (exp < -10) return (uint16_t)sign;
+        mant |= 0x800000u;
+        uint32_t shift = (uint32_t)(14 - exp);
+        uint32_t h = mant >> shift;
+        if ((mant >> (shift - 1)) & 1u) h++;
+        return (uint16_t)(sign | h);
+    }
+    uint32_t h = sign | ((uint32_t)exp << 10) | (mant >> 13);
+    if (mant & 0x1000u) h++;    // a carry into the exponent is still correct
+    return (uint16_t)h;
+}
+
+static float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000u) << 16;
+    uint32_t exp = (h >> 10) & 0x1Fu;
+    uint32_t mant = h & 0x3FFu;
+    uint32_t x;
+    if (exp == 0) {
+        float v = std::ldexp((float)mant, -24);
+        return sign ? -v : v;
+    }
+    if (exp == 31) x = sign | 0x7F800000u | (mant << 13);
+    else x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+void encode_positions(VertexFormat f, const glm::vec3* src, size_t count, void* dst) {
+    if (f == VERTEX_FLOAT3) {
+        float* out = (float*)dst;
+        for (size_t i = 0; i < count; i++) {
+            for (int k = 0; k < 3; k++) out[3*i + k] = src[i][k];
+        }
+        return;
+    }
+    int16_t* out = (int16_t*)dst;
+    for (size_t i = 0; i < count; i++) {
+        for (int k = 0; k < 3; k++) {
+            float v = std::min(1.0f, std::max(-1.0f, src[i][k]));
+            if (f == VERTEX_SNORM16) out[4*i + k] = (int16_t)std::lround(v * 32767.0f);
+            else out[4*i + k] = (int16_t)float_to_half(v);
+        }
+        out[4*i + 3] = 0;
+    }
+}
+
+void decode_positions(VertexFormat f, const void* src, size_t count, glm::vec3* dst) {
+    if (f == VERTEX_FLOAT3) {
+        const float* in = (const float*)src;
+        for (size_t i = 0; i < count; i++) dst[i] = glm::vec3(in[3*i], in[3*i + 1], in[3*i + 2]);
+        return;
+    }
+    const int16_t* in = (const int16_t*)src;
+    for (size_t i = 0; i < count; i++) {
+        for (int k = 0; k < 3; k++) {
+            int16_t c = in[4*i + k];
+            if (f == VERTEX_SNORM16) dst[i][k] = std::max(-1.0f, c / 32767.0f);
+            else dst[i][k] = half_to_float((uint16_t)c);
+        }
+    }
+}
+
+void set_position_attribute(VertexFormat f) {
+    GLsizei stride = (GLsizei)vertex_format_stride(f);
+    if (f == VERTEX_SNORM16) glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, stride, (void*)0);
+    else if (f == VERTEX_HALF) glVertexAttribPointer(0, 3, GL_HALF_FLOAT, GL_FALSE, stride, (void*)0);
+    else glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+    glEnableVertexAttribArray(0);
+}
+
 // ---------------- shape_t ----------------
+static std::atomic<uint32_t> next_mesh_id(1);
+
 shape_t::shape_t(unsigned int tessLevel)
-    : level(tessLevel), VAO(0), VBO(0), buffers_initialized(false) {
-    if (level > 4) level = 4; // clamp
+    : level(tessLevel), mesh_id(next_mesh_id++), bounds_min(0.0f), bounds_max(0.0f), centroid(0.0f), VAO(0), VBO(0), EBO(0),
+      vertex_count(0), index_type(GL_UNSIGNED_INT), index_count(0), vertex_format(VERTEX_FLOAT3),
+      buffers_initialized(false),
+      attached_instance_vbo(0) {
+    if (level > MAX_TESS_LEVEL) level = MAX_TESS_LEVEL; // clamp
 }
 
 shape_t::~shape_t() {
     if (buffers_initialized) {
         glDeleteVertexArrays(1, &VAO);
         glDeleteBuffers(1, &VBO);
+        glDeleteBuffers(1, &EBO);
     }
 }
 
+void shape_t::compute_bounds() {
+    if (vertices.empty()) {
+        bounds_min = bounds_max = centroid = glm::vec3(0.0f);
+        return;
+    }
+    bounds_min = bounds_max = vertices[0];
+    glm::vec3 sum(0.0f);
+    for (const auto& v : vertices) {
+        bounds_min = glm::min(bounds_min, v);
+        bounds_max = glm::max(bounds_max, v);
+        sum += v;
+    }
+    centroid = sum / (float)vertices.size();
+}
+
+// Narrows 32-bit indices straight into the bound element buffer's mapped
+// storage; a temporary copy is only made if the buffer can't be mapped.
+static void upload_short_indices(const std::vector<GLuint>& indices) {
+    GLsizeiptr bytes = (GLsizeiptr)(indices.size() * sizeof(GLushort));
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, bytes, nullptr, GL_STATIC_DRAW);
+    if (!bytes) return;
+
+    GLushort* dst = (GLushort*)glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, bytes,
+                                                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (dst) {
+        for (size_t i = 0; i < indices.size(); i++) dst[i] = (GLushort)indices[i];
+        if (glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER)) return;
+        // storage was lost while mapped; fall through and upload again
+    }
+    std::vector<GLushort> short_indices(indices.begin(), indices.end());
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, bytes, short_indices.data());
+}
+
 void shape_t::setup_buffers() {
     if (buffers_initialized) return;
     
     glGenVertexArrays(1, &VAO);
     glGenBuffers(1, &VBO);
+    glGenBuffers(1, &EBO);
     
     glBindVertexArray(VAO);
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
     
-    // Store vertex positions only (3 floats per vertex)
-    std::vector<float> buffer_data;
-    for (const auto& vertex : vertices) {
-        buffer_data.push_back(vertex.x);
-        buffer_data.push_back(vertex.y);
-        buffer_data.push_back(vertex.z);
+    // float positions are already tightly packed xyz and upload as they
+    // are; packed formats are encoded straight into the mapped buffer
+    static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "vertices must be tightly packed");
+    if (!vertex_format_fits(vertex_format, bounds_min, bounds_max)) vertex_format = VERTEX_FLOAT3;
+    vertex_count = (GLsizei)vertices.size();
+    if (vertex_format == VERTEX_FLOAT3) {
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), vertices.data(), GL_STATIC_DRAW);
+    } else {
+        GLsizeiptr bytes = (GLsizeiptr)(vertices.size() * vertex_format_stride(vertex_format));
+        glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STATIC_DRAW);
+        void* dst = bytes ? glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT)
+                          : nullptr;
+        if (dst) encode_positions(vertex_format, vertices.data(), vertices.size(), dst);
+        if (bytes && (!dst || !glUnmapBuffer(GL_ARRAY_BUFFER))) {
+            std::vector<char> packed((size_t)bytes);
+            encode_positions(vertex_format, vertices.data(), vertices.size(), packed.data());
+            glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, packed.data());
+        }
     }
     
-    glBufferData(GL_ARRAY_BUFFER, buffer_data.size() * sizeof(float), buffer_data.data(), GL_STATIC_DRAW);
-    
     // Position attribute (location 0)
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
+    set_position_attribute(vertex_format);
+
+    // Element buffer stays bound to the VAO; use 16-bit indices when possible
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    index_count = (GLsizei)indices.size();
+    if (vertices.size() <= 0xFFFF) {
+        index_type = GL_UNSIGNED_SHORT;
+        upload_short_indices(indices);
+    } else {
+        index_type = GL_UNSIGNED_INT;
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    }
     
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     
     buffers_initialized = true;
 }
 
+void shape_t::draw_elements() const {
+    if (!buffers_initialized) return;
+    glBindVertexArray(VAO);
+    glDrawElements(GL_TRIANGLES, index_count, index_type, (void*)0);
+}
+
+void shape_t::draw_instanced(GLsizei instance_count) const {
+    if (!buffers_initialized || instance_count <= 0) return;
+    glBindVertexArray(VAO);
+    glDrawElementsInstanced(GL_TRIANGLES, index_count, index_type, (void*)0, instance_count);
+}
+
+void shape_t::release_cpu_data() {
+    if (!buffers_initialized) return;  // GL buffers are the only other copy
+    std::vector<glm::vec3>().swap(vertices);
+    std::vector<GLuint>().swap(indices);
+}
+
+bool shape_t::read_back(std::vector<glm::vec3>& positions, std::vector<GLuint>& out_indices) const {
+    if (!has_cpu_data()) {
+        if (!buffers_initialized) return false;
+        // GL_COPY_READ_BUFFER leaves the element binding of the bound VAO alone
+        std::vector<char> packed(vertex_count * vertex_format_stride(vertex_format));
+        glBindBuffer(GL_COPY_READ_BUFFER, VBO);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, packed.size(), packed.data());
+        positions.resize(vertex_count);
+        decode_positions(vertex_format, packed.data(), vertex_count, positions.data());
+        out_indices.resize(index_count);
+        glBindBuffer(GL_COPY_READ_BUFFER, EBO);
+        if (index_type == GL_UNSIGNED_SHORT) {
+            std::vector<GLushort> short_indices(index_count);
+            glGetBufferSubData(GL_COPY_READ_BUFFER, 0, index_count * sizeof(GLushort), short_indices.data());
+            out_indices.assign(short_indices.begin(), short_indices.end());
+        } else {
+            glGetBufferSubData(GL_COPY_READ_BUFFER, 0, index_count * sizeof(GLuint), out_indices.data());
+        }
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        return true;
+    }
+    positions = vertices;
+    out_indices = indices;
+    return true;
+}
+
+void shape_t::attach_instance_buffer(GLuint instance_vbo) const {
+    if (!buffers_initialized || attached_instance_vbo == instance_vbo) return;
+
+    // mat4 model (locations 1-4) followed by vec4 color (location 5)
+    const GLsizei stride = sizeof(glm::mat4) + sizeof(glm::vec4);
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+    for (GLuint i = 0; i < 5; i++) {
+        glVertexAttribPointer(1 + i, 4, GL_FLOAT, GL_FALSE, stride, (void*)(i * sizeof(glm::vec4)));
+        glEnableVertexAttribArray(1 + i);
+        glVertexAttribDivisor(1 + i, 1);
+    }
+    glBindVertexArray(0);
+
+    attached_instance_vbo = instance_vbo;
+}
+
 // ---------------- sphere_t ----------------
-sphere_t::sphere_t(unsigned int tessLevel)
+sphere_t::sphere_t(unsigned int tessLevel, bool generate)
     : shape_t(tessLevel) {
     shapetype = SPHERE_SHAPE;
-    makeSphere();
+    if (!generate) return;
+    this->generate(nullptr);
     setup_buffers();
 }
 
-void sphere_t::makeSphere() {
-    vertices.clear();
-    colors.clear();
+void sphere_t::generate(thread_pool_t* pool) {
+    makeSphere(pool);
+    compute_bounds();
+}
 
-    unsigned int stacks = 6 * (1u << level);
-    unsigned int slices = 6 * (1u << level);
-    if (stacks < 6) stacks = 6;
-    if (slices < 6) slices = 6;
+// Rings per worker task; smaller meshes are filled on one thread
+static const size_t SPHERE_RINGS_PER_TASK = 32;
 
-    for (unsigned int i = 0; i < stacks; i++) {
-        float phi1 = M_PI * i / stacks;
-        float phi2 = M_PI * (i+1) / stacks;
+// Cosine and sine of 2*pi*j/n for every slice j, computed once per mesh
+static void slice_table(unsigned int n, std::vector<float>& cos_t, std::vector<float>& sin_t) {
+    cos_t.resize(n);
+    sin_t.resize(n);
+    for (unsigned int j = 0; j < n; j++) {
+        double theta = 2*M_PI * j / n;
+        cos_t[j] = (float)cos(theta);
+        sin_t[j] = (float)sin(theta);
+    }
+}
 
-        for (unsigned int j = 0; j < slices; j++) {
-            float theta1 = 2*M_PI * j / slices;
-            float theta2 = 2*M_PI * (j+1) / slices;
+void sphere_t::makeSphere(thread_pool_t* pool) {
+    const unsigned int stacks = sphere_t::stacks(level);
+    const unsigned int slices = sphere_t::slices(level);
+    const GLuint south = vertex_count(level) - 1;
+
+    vertices.resize(vertex_count(level));
+    indices.resize(index_count(level));
+
+    std::vector<float> cos_t, sin_t;
+    slice_table(slices, cos_t, sin_t);
+
+    // north pole, (stacks-1) rings of slices vertices, south pole
+    vertices[0] = glm::vec3(0, 1, 0);
+    vertices[south] = glm::vec3(0, -1, 0);
+
+    // ring(i, j) is vertex j of ring i (1..stacks-1), wrapping at the seam
+    auto ring = [slices](unsigned int i, unsigned int j) -> GLuint {
+        return 1 + (i-1)*slices + (j % slices);
+    };
 
-            glm::vec4 p1( sin(phi1)*cos(theta1), cos(phi1), sin(phi1)*sin(theta1), 1.0f );
-            glm::vec4 p2( sin(phi2)*cos(theta1), cos(phi2), sin(phi2)*sin(theta1), 1.0f );
-            glm::vec4 p3( sin(phi2)*cos(theta2), cos(phi2), sin(phi2)*sin(theta2), 1.0f );
-            glm::vec4 p4( sin(phi1)*cos(theta2), cos(phi1), sin(phi1)*sin(theta2), 1.0f );
+    // Writes ring i and the triangles joining it to the ring (or pole)
+    // above; the bottom ring also closes the south cap. Ranges of rings
+    // touch disjoint parts of the buffers.
+    auto fill = [&](size_t first, size_t last) {
+        for (unsigned int i = (unsigned int)first; i < last; i++) {
+            double phi = M_PI * i / stacks;
+            float sp = (float)sin(phi), cp = (float)cos(phi);
+            glm::vec3* v = &vertices[ring(i, 0)];
+            for (unsigned int j = 0; j < slices; j++) v[j] = glm::vec3(sp*cos_t[j], cp, sp*sin_t[j]);
 
-            // two triangles per quad
-            vertices.push_back(p1); colors.push_back(glm::vec4(1,0,0,1));
-            vertices.push_back(p2); colors.push_back(glm::vec4(0,1,0,1));
-            vertices.push_back(p3); colors.push_back(glm::vec4(0,0,1,1));
+            if (i == 1) {
+                GLuint* idx = &indices[0];
+                for (unsigned int j = 0; j < slices; j++) {
+                    *idx++ = 0; *idx++ = ring(1, j); *idx++ = ring(1, j+1);
+                }
+            } else {
+                GLuint* idx = &indices[3*slices + (i-2)*6*slices];
+                for (unsigned int j = 0; j < slices; j++) {
+                    GLuint p1 = ring(i-1, j), p2 = ring(i, j), p3 = ring(i, j+1), p4 = ring(i-1, j+1);
 
-            vertices.push_back(p1); colors.push_back(glm::vec4(1,0,0,1));
-            vertices.push_back(p3); colors.push_back(glm::vec4(0,0,1,1));
-            vertices.push_back(p4); colors.push_back(glm::vec4(1,1,0,1));
+                    // two triangles per quad
+                    *idx++ = p1; *idx++ = p2; *idx++ = p3;
+                    *idx++ = p1; *idx++ = p3; *idx++ = p4;
+                }
+            }
+
+            if (i == stacks - 1) {
+                GLuint* idx = &indices[3*slices + (stacks-2)*6*slices];
+                for (unsigned int j = 0; j < slices; j++) {
+                    *idx++ = ring(i, j); *idx++ = south; *idx++ = ring(i, j+1);
+                }
+            }
         }
-    }
+    };
+
+    if (pool) pool->parallel_for(1, stacks, SPHERE_RINGS_PER_TASK, fill);
+    else fill(1, stacks);
 }
 
 void sphere_t::draw() const {
-    if (!buffers_initialized) return;
-    glBindVertexArray(VAO);
-    glDrawArrays(GL_TRIANGLES, 0, vertices.size());
+    draw_elements();
 }
 
 // ---------------- cylinder_t ----------------
-cylinder_t::cylinder_t(unsigned int tessLevel)
+cylinder_t::cylinder_t(unsigned int tessLevel, bool generate)
     : shape_t(tessLevel) {
     shapetype = CYLINDER_SHAPE;
-    makeCylinder();
+    if (!generate) return;
+    this->generate(nullptr);
     setup_buffers();
 }
 
-void cylinder_t::makeCylinder() {
-    vertices.clear();
-    colors.clear();
+void cylinder_t::generate(thread_pool_t* pool) {
+    (void)pool;  // two rings, nothing worth splitting
+    makeCylinder();
+    compute_bounds();
+}
 
-    unsigned int slices = 8 * (1u << level);
-    if (slices < 8) slices = 8;
+void cylinder_t::makeCylinder() {
+    const unsigned int slices = cylinder_t::slices(level);
     float height = 1.0f;
     float radius = 0.5f;
 
-    // Side faces
-    for (unsigned int i=0; i<slices; i++) {
-        float theta1 = 2*M_PI*i/slices;
-        float theta2 = 2*M_PI*(i+1)/slices;
-        glm::vec4 p1(radius*cos(theta1), -height/2, radius*sin(theta1), 1.0f);
-        glm::vec4 p2(radius*cos(theta2), -height/2, radius*sin(theta2), 1.0f);
-        glm::vec4 p3(radius*cos(theta2),  height/2, radius*sin(theta2), 1.0f);
-        glm::vec4 p4(radius*cos(theta1),  height/2, radius*sin(theta1), 1.0f);
+    vertices.resize(vertex_count(level));
+    indices.resize(index_count(level));
 
-        // side quad as two triangles
-        vertices.push_back(p1); colors.push_back(glm::vec4(1,0,0,1));
-        vertices.push_back(p2); colors.push_back(glm::vec4(0,1,0,1));
-        vertices.push_back(p3); colors.push_back(glm::vec4(0,0,1,1));
+    std::vector<float> cos_t, sin_t;
+    slice_table(slices, cos_t, sin_t);
 
-        vertices.push_back(p1); colors.push_back(glm::vec4(1,0,0,1));
-        vertices.push_back(p3); colors.push_back(glm::vec4(0,0,1,1));
-        vertices.push_back(p4); colors.push_back(glm::vec4(1,1,0,1));
+    // bottom ring [0, slices), top ring [slices, 2*slices), then cap centers
+    for (unsigned int i=0; i<slices; i++) {
+        vertices[i] = glm::vec3(radius*cos_t[i], -height/2, radius*sin_t[i]);
+        vertices[slices + i] = glm::vec3(radius*cos_t[i], height/2, radius*sin_t[i]);
     }
-    
-    // caps
-    glm::vec4 centerBottom(0,-height/2,0,1), centerTop(0,height/2,0,1);
+    GLuint centerBottom = 2*slices, centerTop = 2*slices + 1;
+    vertices[centerBottom] = glm::vec3(0,-height/2,0);
+    vertices[centerTop] = glm::vec3(0, height/2,0);
+
+    GLuint* idx = indices.data();
     for (unsigned int i=0; i<slices; i++) {
-        float t1=2*M_PI*i/slices, t2=2*M_PI*(i+1)/slices;
-        glm::vec4 b1(radius*cos(t1), -height/2, radius*sin(t1),1);
-        glm::vec4 b2(radius*cos(t2), -height/2, radius*sin(t2),1);
-        vertices.push_back(centerBottom); colors.push_back(glm::vec4(1,0,1,1));
-        vertices.push_back(b1); colors.push_back(glm::vec4(0,1,1,1));
-        vertices.push_back(b2); colors.push_back(glm::vec4(1,1,1,1));
-        
-        glm::vec4 t1v(radius*cos(t1), height/2, radius*sin(t1),1);
-        glm::vec4 t2v(radius*cos(t2), height/2, radius*sin(t2),1);
-        vertices.push_back(centerTop); colors.push_back(glm::vec4(1,0,1,1));
-        vertices.push_back(t2v); colors.push_back(glm::vec4(0,1,1,1));
-        vertices.push_back(t1v); colors.push_back(glm::vec4(1,1,1,1));
+        GLuint b1 = i, b2 = (i+1) % slices;
+        GLuint t1 = slices + b1, t2 = slices + b2;
+
+        // side quad as two triangles
+        *idx++ = b1; *idx++ = b2; *idx++ = t2;
+        *idx++ = b1; *idx++ = t2; *idx++ = t1;
+
+        // caps
+        *idx++ = centerBottom; *idx++ = b1; *idx++ = b2;
+        *idx++ = centerTop; *idx++ = t2; *idx++ = t1;
     }
 }
 
 void cylinder_t::draw() const {
-    if (!buffers_initialized) return;
-    glBindVertexArray(VAO);
-    glDrawArrays(GL_TRIANGLES, 0, vertices.size());
+    draw_elements();
 }
 
 // ---------------- box_t ----------------
-box_t::box_t(unsigned int tessLevel)
+box_t::box_t(unsigned int tessLevel, bool generate)
     : shape_t(tessLevel) {
     shapetype = BOX_SHAPE;
-    makeBox();
+    if (!generate) return;
+    this->generate(nullptr);
     setup_buffers();
 }
 
-void box_t::makeBox() {
-    vertices.clear();
-    colors.clear();
+void box_t::generate(thread_pool_t* pool) {
+    (void)pool;
+    makeBox();
+    compute_bounds();
+}
 
+void box_t::makeBox() {
     float h=0.5f;
-    glm::vec4 pts[8] = {
-        {-h,-h,-h,1}, {h,-h,-h,1}, {h,h,-h,1}, {-h,h,-h,1},
-        {-h,-h,h,1},  {h,-h,h,1},  {h,h,h,1},  {-h,h,h,1}
-    };
-    int faces[6][4] = {
+    static const int faces[6][4] = {
         {0,1,2,3}, {4,7,6,5}, {0,4,5,1},
         {2,6,7,3}, {0,3,7,4}, {1,5,6,2}
     };
-    glm::vec4 cols[6] = {
-        {1,0,0,1},{0,1,0,1},{0,0,1,1},
-        {1,1,0,1},{0,1,1,1},{1,0,1,1}
+    const glm::vec3 pts[8] = {
+        {-h,-h,-h}, {h,-h,-h}, {h,h,-h}, {-h,h,-h},
+        {-h,-h,h},  {h,-h,h},  {h,h,h},  {-h,h,h}
     };
-    
-    for(int f=0; f<6; f++) {
-        int* q = faces[f];
-        vertices.push_back(pts[q[0]]); colors.push_back(cols[f]);
-        vertices.push_back(pts[q[1]]); colors.push_back(cols[f]);
-        vertices.push_back(pts[q[2]]); colors.push_back(cols[f]);
 
-        vertices.push_back(pts[q[0]]); colors.push_back(cols[f]);
-        vertices.push_back(pts[q[2]]); colors.push_back(cols[f]);
-        vertices.push_back(pts[q[3]]); colors.push_back(cols[f]);
+    vertices.assign(pts, pts + 8);
+    indices.resize(index_count(0));
+    GLuint* idx = indices.data();
+    for(int f=0; f<6; f++) {
+        const int* q = faces[f];
+        *idx++ = q[0]; *idx++ = q[1]; *idx++ = q[2];
+        *idx++ = q[0]; *idx++ = q[2]; *idx++ = q[3];
     }
 }
 
 void box_t::draw() const {
-    if (!buffers_initialized) return;
-    glBindVertexArray(VAO);
-    glDrawArrays(GL_TRIANGLES, 0, vertices.size());
+    draw_elements();
 }
 
 // ---------------- cone_t ----------------
-cone_t::cone_t(unsigned int tessLevel)
+cone_t::cone_t(unsigned int tessLevel, bool generate)
     : shape_t(tessLevel) {
     shapetype = CONE_SHAPE;
-    makeCone();
+    if (!generate) return;
+    this->generate(nullptr);
     setup_buffers();
 }
 
-void cone_t::makeCone() {
-    vertices.clear();
-    colors.clear();
+void cone_t::generate(thread_pool_t* pool) {
+    (void)pool;  // one ring, nothing worth splitting
+    makeCone();
+    compute_bounds();
+}
 
-    unsigned int slices = 8 * (1u << level);
-    if (slices < 8) slices = 8;
+void cone_t::makeCone() {
+    const unsigned int slices = cone_t::slices(level);
     float radius = 0.5f;
     float height = 1.0f;
-    glm::vec4 apex(0,height/2,0,1);
-    glm::vec4 center(0,-height/2,0,1);
 
+    vertices.resize(vertex_count(level));
+    indices.resize(index_count(level));
+
+    std::vector<float> cos_t, sin_t;
+    slice_table(slices, cos_t, sin_t);
+
+    // apex, base center, then the base ring
+    vertices[0] = glm::vec3(0,height/2,0);
+    vertices[1] = glm::vec3(0,-height/2,0);
+    for (unsigned int i=0; i<slices; i++) {
+        vertices[2 + i] = glm::vec3(radius*cos_t[i], -height/2, radius*sin_t[i]);
+    }
+
+    GLuint* idx = indices.data();
     for (unsigned int i=0; i<slices; i++) {
-        float t1=2*M_PI*i/slices, t2=2*M_PI*(i+1)/slices;
-        glm::vec4 b1(radius*cos(t1), -height/2, radius*sin(t1),1);
-        glm::vec4 b2(radius*cos(t2), -height/2, radius*sin(t2),1);
-        
+        GLuint b1 = 2 + i, b2 = 2 + (i+1) % slices;
+
         // side triangles
-        vertices.push_back(apex); colors.push_back(glm::vec4(1,0,0,1));
-        vertices.push_back(b1);   colors.push_back(glm::vec4(0,1,0,1));
-        vertices.push_back(b2);   colors.push_back(glm::vec4(0,0,1,1));
-        
+        *idx++ = 0; *idx++ = b1; *idx++ = b2;
+
         // base triangles
-        vertices.push_back(center); colors.push_back(glm::vec4(1,1,0,1));
-        vertices.push_back(b2);     colors.push_back(glm::vec4(0,1,1,1));
-        vertices.push_back(b1);     colors.push_back(glm::vec4(1,0,1,1));
+        *idx++ = 1; *idx++ = b2; *idx++ = b1;
     }
 }
 
 void cone_t::draw() const {
-    if (!buffers_initialized) return;
-    glBindVertexArray(VAO);
-    glDrawArrays(GL_TRIANGLES, 0, vertices.size());
+    draw_elements();
+}
+
+// ---------------- shape_cache_t ----------------
+shape_cache_t& shape_cache_t::instance() {
+    static shape_cache_t cache;
+    return cache;
+}
+
+shape_cache_t::shape_cache_t() : release_cpu_copies(false), format(VERTEX_FLOAT3) {
+    for (int t = 0; t < NUM_SHAPE_TYPES; t++)
+        for (unsigned int l = 0; l <= MAX_TESS_LEVEL; l++)
+            entries[t][l] = entry{nullptr, 0, false};
+}
+
+shape_cache_t::~shape_cache_t() {
+    // Any meshes still referenced here outlived their models; the GL
+    // context is usually gone by now, so just drop the CPU side.
+    for (int t = 0; t < NUM_SHAPE_TYPES; t++) {
+        for (unsigned int l = 0; l <= MAX_TESS_LEVEL; l++) {
+            shape_t* s = entries[t][l].shape;
+            if (!s) continue;
+            s->buffers_initialized = false;
+            delete s;
+        }
+    }
+}
+
+unsigned int shape_cache_t::normalize_level(ShapeType type, unsigned int level) {
+    if (type == BOX_SHAPE) return 0;
+    return level > MAX_TESS_LEVEL ? MAX_TESS_LEVEL : level;
+}
+
+const shape_t* shape_cache_t::acquire(ShapeType type, unsigned int level) {
+    if (type < 0 || type >= NUM_SHAPE_TYPES) return nullptr;
+    level = normalize_level(type, level);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    entry& e = wait_ready(lock, type, level);
+    if (!e.shape) {
+        e.shape = create(type, level, false);
+        if (!e.shape) return nullptr;
+        build(e.shape);
+        e.ready = true;
+    } else if (unqueue(e.shape)) {
+        upload(e.shape);  // needed now, don't wait for the budgeted uploads
+    }
+    e.refs++;
+    return e.shape;
+}
+
+void shape_cache_t::acquire_batch(const ShapeType* types, const unsigned int* levels, size_t count,
+                                  const shape_t** out, bool upload_now) {
+    // Placeholders first, so duplicates in the list are generated once,
+    // and refs, so nothing is freed while the lock is dropped below
+    std::vector<shape_t*> fresh;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < count; i++) {
+            out[i] = nullptr;
+            if (types[i] < 0 || types[i] >= NUM_SHAPE_TYPES) continue;
+            entry& e = entries[types[i]][normalize_level(types[i], levels[i])];
+            if (!e.shape) {
+                e.shape = create(types[i], normalize_level(types[i], levels[i]), false);
+                e.ready = false;
+                fresh.push_back(e.shape);
+            }
+            e.refs++;
+            out[i] = e.shape;
+        }
+    }
+
+    // tessellation is CPU-only and runs unlocked; each mesh is published
+    // as soon as it is done
+    thread_pool_t& pool = thread_pool_t::instance();
+    pool.parallel_for(0, fresh.size(), 1, [&](size_t b, size_t e) {
+        for (size_t i = b; i < e; i++) {
+            shape_t* s = fresh[i];
+            s->generate(&pool);
+            std::lock_guard<std::mutex> lock(mutex);
+            entries[s->shapetype][s->level].ready = true;
+            if (!upload_now) pending.push_back(s);
+            generated.notify_all();
+        }
+    });
+
+    // GL uploads stay on the calling thread
+    if (upload_now && !fresh.empty()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto s : fresh) upload(s);
+    }
+}
+
+void shape_cache_t::build(shape_t* s) {
+    s->generate(&thread_pool_t::instance());
+    upload(s);
+}
+
+void shape_cache_t::upload(shape_t* s) {
+    s->vertex_format = format;
+    s->setup_buffers();
+    if (release_cpu_copies) s->release_cpu_data();
+}
+
+// The entry for (type, level), once any acquire_batch() building it is done
+shape_cache_t::entry& shape_cache_t::wait_ready(std::unique_lock<std::mutex>& lock, ShapeType type,
+                                                unsigned int level) {
+    entry& e = entries[type][level];
+    generated.wait(lock, [&e]() { return !e.shape || e.ready; });
+    return e;
+}
+
+bool shape_cache_t::unqueue(shape_t* s) {
+    auto it = std::find(pending.begin(), pending.end(), s);
+    if (it == pending.end()) return false;
+    pending.erase(it);
+    return true;
+}
+
+size_t shape_cache_t::upload_pending(double budget_ms) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto start = std::chrono::steady_clock::now();
+    size_t done = 0;
+    while (done < pending.size()) {
+        upload(pending[done++]);
+        std::chrono::duration<double, std::milli> spent = std::chrono::steady_clock::now() - start;
+        if (spent.count() >= budget_ms) break;
+    }
+    pending.erase(pending.begin(), pending.begin() + done);
+    return pending.size();
+}
+
+size_t shape_cache_t::pending_uploads() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending.size();
+}
+
+const shape_t* shape_cache_t::acquire(ShapeType type, unsigned int level,
+                                      const float* positions, unsigned int vertex_count,
+                                      const GLuint* indices, unsigned int index_count,
+                                      bool upload_now) {
+    if (type < 0 || type >= NUM_SHAPE_TYPES) return nullptr;
+    level = normalize_level(type, level);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    entry& e = wait_ready(lock, type, level);
+    if (!e.shape) {
+        shape_t* s = create(type, level, false);
+        if (!s) return nullptr;
+        s->vertices.resize(vertex_count);
+        for (unsigned int i = 0; i < vertex_count; i++) {
+            s->vertices[i] = glm::vec3(positions[3*i], positions[3*i+1], positions[3*i+2]);
+        }
+        s->indices.assign(indices, indices + index_count);
+        s->compute_bounds();
+        if (upload_now) upload(s);
+        else pending.push_back(s);
+        e.shape = s;
+        e.ready = true;
+    }
+    e.refs++;
+    return e.shape;
+}
+
+shape_t* shape_cache_t::create(ShapeType type, unsigned int level, bool generate) {
+    switch (type) {
+        case SPHERE_SHAPE: return new sphere_t(level, generate);
+        case CYLINDER_SHAPE: return new cylinder_t(level, generate);
+        case BOX_SHAPE: return new box_t(0, generate);
+        case CONE_SHAPE: return new cone_t(level, generate);
+        default: return nullptr;
+    }
+}
+
+void shape_cache_t::release(const shape_t* s) {
+    if (!s) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    entry& e = entries[s->shapetype][normalize_level(s->shapetype, s->level)];
+    if (e.shape != s || e.refs == 0) return;
+    if (--e.refs == 0) {
+        unqueue(e.shape);
+        delete e.shape;
+        e.shape = nullptr;
+    }
+}
+
+size_t shape_cache_t::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t n = 0;
+    for (int t = 0; t < NUM_SHAPE_TYPES; t++)
+        for (unsigned int l = 0; l <= MAX_TESS_LEVEL; l++)
+            if (entries[t][l].shape) n++;
+    return n;
 }
\ No newline at end of file
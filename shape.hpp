@@ -2,6 +2,9 @@
 #define SHAPE_HPP
 
 #include <vector>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
 #include <glm/glm.hpp>
 #include <GL/glew.h>
 
@@ -9,60 +12,212 @@ enum ShapeType {
     SPHERE_SHAPE,
     CYLINDER_SHAPE,
     BOX_SHAPE,
-    CONE_SHAPE
+    CONE_SHAPE,
+    NUM_SHAPE_TYPES
 };
 
+const unsigned int MAX_TESS_LEVEL = 4;
+
+// Position layouts in GL vertex buffers. The packed ones store xyz plus a
+// pad to keep 4-byte alignment, cover [-1, 1] (which the unit primitives
+// fit in) and are widened to vec3 by the vertex fetch, so the shaders
+// read aPos the same way for every format.
+enum VertexFormat {
+    VERTEX_FLOAT3,      // 12 bytes, exact
+    VERTEX_SNORM16,     // 8 bytes, normalized GL_SHORT, step 1/32767
+    VERTEX_HALF,        // 8 bytes, GL_HALF_FLOAT, ~11-bit mantissa
+    NUM_VERTEX_FORMATS
+};
+
+const char* vertex_format_name(VertexFormat f);
+bool parse_vertex_format(const char* name, VertexFormat& f);
+size_t vertex_format_stride(VertexFormat f);
+// false if a packed format can't hold positions in this box
+bool vertex_format_fits(VertexFormat f, const glm::vec3& min, const glm::vec3& max);
+// dst holds count * vertex_format_stride(f) bytes
+void encode_positions(VertexFormat f, const glm::vec3* src, size_t count, void* dst);
+void decode_positions(VertexFormat f, const void* src, size_t count, glm::vec3* dst);
+// glVertexAttribPointer for location 0 of the bound VAO and GL_ARRAY_BUFFER
+void set_position_attribute(VertexFormat f);
+
+class thread_pool_t;
+
 class shape_t {
 public:
-    std::vector<glm::vec4> vertices;
-    std::vector<glm::vec4> colors;
+    // CPU copy of the mesh, tightly packed so it uploads without
+    // conversion. Empty after release_cpu_data().
+    std::vector<glm::vec3> vertices;
+    std::vector<GLuint> indices;    // triangle list into vertices
     ShapeType shapetype;
     unsigned int level;
+    uint32_t mesh_id;               // unique for the process lifetime, never reused
+
+    // Local-space bounding box and mean of the vertices, computed once
+    // when the mesh is generated
+    glm::vec3 bounds_min, bounds_max;
+    glm::vec3 centroid;
     
     // OpenGL buffers
-    GLuint VAO, VBO;
+    GLuint VAO, VBO, EBO;
+    GLsizei vertex_count;           // kept when the CPU copy is released
+    GLenum index_type;              // GL_UNSIGNED_SHORT when it fits, else GL_UNSIGNED_INT
+    GLsizei index_count;
+    VertexFormat vertex_format;     // requested before upload; VERTEX_FLOAT3 if the mesh doesn't fit
     bool buffers_initialized;
 
     shape_t(unsigned int tessLevel);
     virtual ~shape_t();
 
     virtual void draw() const = 0;
+    void draw_instanced(GLsizei instance_count) const;
+
+    // Point attributes 1-5 (model matrix columns + color, divisor 1) of this
+    // shape's VAO at an interleaved instance_data buffer.
+    void attach_instance_buffer(GLuint instance_vbo) const;
+
+    // Frees vertices/indices once the GL buffers hold the mesh; bounds,
+    // centroid and counts stay valid.
+    void release_cpu_data();
+    bool has_cpu_data() const { return !vertices.empty(); }
+    // The mesh from the CPU copy, or read back from GL if it was released
+    // (decoded, so only as exact as vertex_format)
+    bool read_back(std::vector<glm::vec3>& positions, std::vector<GLuint>& out_indices) const;
     
 protected:
-    void setup_buffers();  // Setup VAO/VBO for modern OpenGL
+    friend class shape_cache_t;
+    mutable GLuint attached_instance_vbo;
+
+    // Fills vertices, indices and bounds without touching GL, so it can run
+    // on a worker thread. A pool, if given, may split large meshes further.
+    virtual void generate(thread_pool_t* pool) = 0;
+    void compute_bounds();  // also fills centroid
+    void setup_buffers();  // Setup VAO/VBO/EBO for modern OpenGL
+    void draw_elements() const;
 };
 
 // Derived shapes
+// Each shape's mesh size per level is known at compile time, so the
+// generators size their buffers exactly once.
 class sphere_t : public shape_t {
 public:
-    sphere_t(unsigned int tessLevel = 0);
+    static constexpr unsigned int stacks(unsigned int level) { return 6u << level; }
+    static constexpr unsigned int slices(unsigned int level) { return 6u << level; }
+    static constexpr unsigned int vertex_count(unsigned int level) { return (stacks(level) - 1) * slices(level) + 2; }
+    static constexpr unsigned int index_count(unsigned int level) { return 6 * slices(level) * (stacks(level) - 1); }
+
+    sphere_t(unsigned int tessLevel = 0, bool generate = true);
     void draw() const override;
+protected:
+    void generate(thread_pool_t* pool) override;
 private:
-    void makeSphere();
+    void makeSphere(thread_pool_t* pool);
 };
 
 class cylinder_t : public shape_t {
 public:
-    cylinder_t(unsigned int tessLevel = 0);
+    static constexpr unsigned int slices(unsigned int level) { return 8u << level; }
+    static constexpr unsigned int vertex_count(unsigned int level) { return 2 * slices(level) + 2; }
+    static constexpr unsigned int index_count(unsigned int level) { return 12 * slices(level); }
+
+    cylinder_t(unsigned int tessLevel = 0, bool generate = true);
     void draw() const override;
+protected:
+    void generate(thread_pool_t* pool) override;
 private:
     void makeCylinder();
 };
 
 class box_t : public shape_t {
 public:
-    box_t(unsigned int tessLevel = 0);
+    static constexpr unsigned int vertex_count(unsigned int) { return 8; }
+    static constexpr unsigned int index_count(unsigned int) { return 36; }
+
+    box_t(unsigned int tessLevel = 0, bool generate = true);
     void draw() const override;
+protected:
+    void generate(thread_pool_t* pool) override;
 private:
     void makeBox();
 };
 
 class cone_t : public shape_t {
 public:
-    cone_t(unsigned int tessLevel = 0);
+    static constexpr unsigned int slices(unsigned int level) { return 8u << level; }
+    static constexpr unsigned int vertex_count(unsigned int level) { return slices(level) + 2; }
+    static constexpr unsigned int index_count(unsigned int level) { return 6 * slices(level); }
+
+    cone_t(unsigned int tessLevel = 0, bool generate = true);
     void draw() const override;
+protected:
+    void generate(thread_pool_t* pool) override;
 private:
     void makeCone();
 };
 
+// Shared geometry cache: one immutable, reference-counted shape per
+// (type, tessellation level). Boxes ignore the level and always use 0.
+// All calls are thread-safe. Calls that upload (upload == true, and
+// upload_pending()) must come from the thread owning the GL context.
+class shape_cache_t {
+public:
+    static shape_cache_t& instance();
+
+    // GL thread only; also uploads the mesh if a deferred load left it pending
+    const shape_t* acquire(ShapeType type, unsigned int level);
+    // Like acquire(), but builds a missing mesh from prebuilt geometry
+    // (xyz floats + triangle indices) instead of tessellating it.
+    const shape_t* acquire(ShapeType type, unsigned int level,
+                           const float* positions, unsigned int vertex_count,
+                           const GLuint* indices, unsigned int index_count,
+                           bool upload = true);
+    // Acquires count meshes at once. Missing ones are tessellated in
+    // parallel on the shared thread pool without holding the cache lock,
+    // then uploaded on this thread, or with upload == false queued for
+    // upload_pending() as each finishes. Other callers asking for one of
+    // them meanwhile wait for that mesh only. out[i] is null for an
+    // invalid type.
+    void acquire_batch(const ShapeType* types, const unsigned int* levels, size_t count,
+                       const shape_t** out, bool upload = true);
+    void release(const shape_t* s);
+
+    // GL thread: uploads queued meshes, at least one, until budget_ms has
+    // passed. Returns how many are still queued.
+    size_t upload_pending(double budget_ms);
+    size_t pending_uploads() const;
+
+    // Drop each mesh's CPU copy right after upload. Affects meshes
+    // created from now on; set it before loading anything.
+    void set_release_cpu_data(bool release) { release_cpu_copies = release; }
+    // applies to meshes uploaded from now on
+    void set_vertex_format(VertexFormat f) { format = f; }
+    VertexFormat vertex_format() const { return format; }
+
+    static unsigned int normalize_level(ShapeType type, unsigned int level);
+    size_t size() const;  // number of live meshes
+
+private:
+    struct entry {
+        shape_t* shape;
+        unsigned int refs;
+        bool ready;     // generated; false while acquire_batch() builds it
+    };
+    entry entries[NUM_SHAPE_TYPES][MAX_TESS_LEVEL + 1];
+    bool release_cpu_copies;
+    VertexFormat format;
+    std::vector<shape_t*> pending;  // generated, waiting for upload_pending()
+    mutable std::mutex mutex;
+    std::condition_variable generated;     // some entry became ready
+
+    static shape_t* create(ShapeType type, unsigned int level, bool generate);
+    void build(shape_t* s);  // generate on the pool + upload
+    void upload(shape_t* s);
+    bool unqueue(shape_t* s);  // true if s was pending
+    entry& wait_ready(std::unique_lock<std::mutex>& lock, ShapeType type, unsigned int level);
+
+    shape_cache_t();
+    ~shape_cache_t();
+    shape_cache_t(const shape_cache_t&);
+    shape_cache_t& operator=(const shape_cache_t&);
+};
+
 #endif
\ No newline at end of file
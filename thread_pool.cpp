@@ -0,0 +1,102 @@
+#include "thread_pool.hpp"
+#include <atomic>
+#include <memory>
+
+thread_pool_t& thread_pool_t::instance() {
+    static thread_pool_t pool(std::thread::hardware_concurrency() > 1
+                              ? std::thread::hardware_concurrency() - 1 : 0);
+    return pool;
+}
+
+thread_pool_t::thread_pool_t(unsigned int threads) : stopping(false) {
+    for (unsigned int i = 0; i < threads; i++) workers.push_back(std::thread(&thread_pool_t::worker_loop, this));
+}
+
+thread_pool_t::~thread_pool_t() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& t : workers) t.join();
+}
+
+void thread_pool_t::submit(std::function<void()> job) {
+    if (workers.empty()) {
+        job();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    wake.notify_one();
+}
+
+void thread_pool_t::worker_loop() {
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;  // stopping and drained
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+namespace {
+
+// Shared by the caller and the helper jobs of one parallel_for; helpers
+// that start late find no ranges left and only drop their reference.
+struct parallel_range {
+    size_t begin, end, grain;
+    std::function<void(size_t, size_t)> fn;
+    std::atomic<size_t> next;
+    std::atomic<size_t> remaining;  // ranges not yet finished
+    std::mutex mutex;
+    std::condition_variable done;
+
+    void run() {
+        for (;;) {
+            size_t b = next.fetch_add(grain);
+            if (b >= end) return;
+            size_t e = end - b < grain ? end : b + grain;
+            fn(b, e);
+            if (remaining.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.notify_all();
+            }
+        }
+    }
+};
+
+}
+
+void thread_pool_t::parallel_for(size_t begin, size_t end, size_t grain,
+                                 const std::function<void(size_t, size_t)>& fn) {
+    if (begin >= end) return;
+    if (grain == 0) grain = 1;
+    size_t ranges = (end - begin + grain - 1) / grain;
+    if (ranges == 1 || workers.empty()) {
+        fn(begin, end);
+        return;
+    }
+
+    std::shared_ptr<parallel_range> r = std::make_shared<parallel_range>();
+    r->begin = begin;
+    r->end = end;
+    r->grain = grain;
+    r->fn = fn;
+    r->next = begin;
+    r->remaining = ranges;
+
+    size_t helpers = ranges - 1 < workers.size() ? ranges - 1 : workers.size();
+    for (size_t i = 0; i < helpers; i++) submit([r]() { r->run(); });
+
+    r->run();
+    std::unique_lock<std::mutex> lock(r->mutex);
+    r->done.wait(lock, [&r]() { return r->remaining.load() == 0; });
+}
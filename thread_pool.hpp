@@ -0,0 +1,47 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads fed from one job queue.
+// parallel_for() may be called from inside a job: the caller always works
+// through the range itself, so nested calls can't deadlock waiting for
+// workers that are busy.
+class thread_pool_t {
+public:
+    // Shared pool with one worker per hardware thread, minus the caller
+    static thread_pool_t& instance();
+
+    explicit thread_pool_t(unsigned int threads);
+    ~thread_pool_t();
+
+    unsigned int size() const { return (unsigned int)workers.size(); }
+
+    void submit(std::function<void()> job);
+
+    // Splits [begin, end) into ranges of at least `grain` items and runs
+    // fn(range_begin, range_end) on the workers and the calling thread.
+    // Returns once every range is done.
+    void parallel_for(size_t begin, size_t end, size_t grain,
+                      const std::function<void(size_t, size_t)>& fn);
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+
+    void worker_loop();
+
+    thread_pool_t(const thread_pool_t&);
+    thread_pool_t& operator=(const thread_pool_t&);
+};
+
+#endif // THREAD_POOL_HPP